@@ -0,0 +1,397 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define FILENAME "/proc/mp1/status"
+
+#define MAX_SAMPLES (1 << 15)          // latencies kept per worker
+#define READ_BUFF_SIZE (64 * 1024)
+#define BURN_NS 1000000ULL             // CPU burnt between registrant writes
+#define VERIFY_SLACK_NS 10000000ULL    // sampling granularity allowance
+#define VERIFY_PCT 5
+
+/* struct series - latencies of one kind of operation */
+struct series {
+   uint64_t ops;
+   uint64_t nr_samples;
+   uint64_t samples[MAX_SAMPLES];      // latency in nsec
+};
+
+/* struct worker - one registrant or reader, lives in shared memory */
+struct worker {
+   struct series lat;                  // reads, or registrations
+   uint64_t bytes;
+   /* registrants only */
+   struct series unreg;
+   int pid;
+   int found;
+   uint64_t rusage_ns;
+   uint64_t reported_ns;
+};
+
+/* struct shared - everything the parent collects from its children */
+struct shared {
+   volatile int go;
+   uint64_t end_ns;
+   struct worker workers[];
+};
+
+static struct shared *shm;
+static int nr_registrants = 8;
+static int nr_readers = 4;
+static int seconds = 10;
+static unsigned int interval_ms = 100;
+
+/* now_ns - monotonic time in nsec */
+static uint64_t now_ns(void) {
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* cpu_ns - CPU time used by this process in nsec */
+static uint64_t cpu_ns(void) {
+   struct timespec ts;
+
+   clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+   return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* record - keeps a latency sample, later ones only count towards ops */
+static void record(struct series *s, uint64_t ns) {
+   if (s->nr_samples < MAX_SAMPLES) {
+      s->samples[s->nr_samples++] = ns;
+   }
+   s->ops++;
+}
+
+/* timed_write - writes a command, returns how long it took in nsec */
+static uint64_t timed_write(int fd, const char *cmd, int len) {
+   uint64_t start;
+
+   start = now_ns();
+   if (write(fd, cmd, len) != len) {
+      perror("write");
+      exit(1);
+   }
+   return now_ns() - start;
+}
+
+/* wait_for_start - spins until the parent releases every worker at once */
+static void wait_for_start(void) {
+   while (!shm->go) {
+      usleep(1000);
+   }
+}
+
+/* read_status - reads the whole status file, returns bytes read or -1 */
+static ssize_t read_status(char *buff, size_t size) {
+   ssize_t res, len;
+   int fd;
+
+   fd = open(FILENAME, O_RDONLY);
+   if (fd < 0) {
+      return -1;
+   }
+
+   /* seq_file hands out a page or so per read */
+   len = 0;
+   while ((res = read(fd, buff, size)) > 0) {
+      len += res;
+   }
+   close(fd);
+
+   return res < 0 ? -1 : len;
+}
+
+/* find_pid - looks pid up in the status file, returns 1 and its
+ * utime_ns + stime_ns if listed */
+static int find_pid(int pid, uint64_t *total) {
+   unsigned long long utime, stime;
+   char line[256];
+   FILE *proc_file;
+   int found;
+
+   proc_file = fopen(FILENAME, "r");
+   if (proc_file == NULL) {
+      return 0;
+   }
+
+   found = 0;
+   while (!found && fgets(line, sizeof(line), proc_file)) {
+      if (atoi(line) == pid &&
+          sscanf(strchr(line, ':') + 1, "%llu %llu", &utime, &stime) == 2) {
+         *total = utime + stime;
+         found = 1;
+      }
+   }
+   fclose(proc_file);
+
+   return found;
+}
+
+/* registrant - registers and unregisters itself while burning CPU, so
+ * every timed write is a real insert or delete, then checks what the module
+ * reports against getrusage */
+static void registrant(struct worker *w) {
+   struct rusage usage;
+   char reg_cmd[64], unreg_cmd[64];
+   uint64_t burn_until;
+   int reg_len, unreg_len;
+   int fd;
+
+   w->pid = getpid();
+   reg_len = snprintf(reg_cmd, sizeof(reg_cmd), "R @%u %d\n", interval_ms, w->pid);
+   unreg_len = snprintf(unreg_cmd, sizeof(unreg_cmd), "U %d\n", w->pid);
+
+   fd = open(FILENAME, O_WRONLY);
+   if (fd < 0) {
+      perror(FILENAME);
+      exit(1);
+   }
+
+   wait_for_start();
+
+   /* re-registering a tracked PID is a no-op, so pair each R with a U */
+   while (now_ns() < shm->end_ns) {
+      record(&w->lat, timed_write(fd, reg_cmd, reg_len));
+
+      burn_until = cpu_ns() + BURN_NS;
+      while (cpu_ns() < burn_until) {
+         ;
+      }
+
+      record(&w->unreg, timed_write(fd, unreg_cmd, unreg_len));
+   }
+
+   /* register for good, idle for two intervals so a sweep catches up, then
+    * compare */
+   timed_write(fd, reg_cmd, reg_len);
+   getrusage(RUSAGE_SELF, &usage);
+   w->rusage_ns = (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000ULL +
+                  (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000ULL;
+   usleep(2 * interval_ms * 1000);
+
+   w->found = find_pid(w->pid, &w->reported_ns);
+
+   timed_write(fd, unreg_cmd, unreg_len);
+   close(fd);
+}
+
+/* reader - reads the status file back to back */
+static void reader(struct worker *w) {
+   char *buff;
+   uint64_t start;
+   ssize_t len;
+
+   buff = malloc(READ_BUFF_SIZE);
+   if (!buff) {
+      exit(1);
+   }
+
+   wait_for_start();
+
+   while (now_ns() < shm->end_ns) {
+      start = now_ns();
+      len = read_status(buff, READ_BUFF_SIZE);
+      if (len < 0) {
+         perror(FILENAME);
+         exit(1);
+      }
+      record(&w->lat, now_ns() - start);
+      w->bytes += len;
+   }
+
+   free(buff);
+}
+
+/* cmp_u64 - qsort comparator */
+static int cmp_u64(const void *a, const void *b) {
+   uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+   return x < y ? -1 : x > y;
+}
+
+/* percentile - pct-th percentile of sorted samples, in usec */
+static double percentile(uint64_t *samples, uint64_t nr, unsigned int pct) {
+   if (nr == 0) {
+      return 0;
+   }
+   return samples[(nr - 1) * pct / 100] / 1000.0;
+}
+
+/* worker_series - picks a worker's series by its offset in struct worker */
+static struct series *worker_series(struct worker *w, size_t offset) {
+   return (struct series *) ((char *) w + offset);
+}
+
+/* summarize - prints ops, ops/s and latency percentiles of one series over a
+ * worker range */
+static void summarize(struct worker **workers, int nr, size_t offset, double secs) {
+   struct series *s;
+   uint64_t *samples;
+   uint64_t nr_samples, ops;
+   int i;
+
+   nr_samples = 0;
+   ops = 0;
+   for (i = 0; i < nr; i++) {
+      s = worker_series(workers[i], offset);
+      nr_samples += s->nr_samples;
+      ops += s->ops;
+   }
+
+   samples = malloc((nr_samples + 1) * sizeof(*samples));
+   if (!samples) {
+      exit(1);
+   }
+   nr_samples = 0;
+   for (i = 0; i < nr; i++) {
+      s = worker_series(workers[i], offset);
+      memcpy(samples + nr_samples, s->samples, s->nr_samples * sizeof(*samples));
+      nr_samples += s->nr_samples;
+   }
+   qsort(samples, nr_samples, sizeof(*samples), cmp_u64);
+
+   printf(",%llu,%.1f,%.1f,%.1f,%.1f,%.1f", (unsigned long long) ops, ops / secs,
+          percentile(samples, nr_samples, 50), percentile(samples, nr_samples, 90),
+          percentile(samples, nr_samples, 99),
+          nr_samples ? samples[nr_samples - 1] / 1000.0 : 0.0);
+
+   free(samples);
+}
+
+/* usage - prints options and exits */
+static void usage(const char *name) {
+   fprintf(stderr,
+           "usage: %s [-n registrants] [-m readers] [-d seconds] [-i interval_ms]\n"
+           "          [-l label] [-H]\n"
+           "Prints one CSV row, with a header unless -H is given.\n", name);
+   exit(2);
+}
+
+int main(int argc, char* argv[])
+{
+   struct worker **workers;
+   const char *label = "";
+   size_t shm_size;
+   uint64_t read_bytes, err, max_err;
+   double secs;
+   int header = 1;
+   int nr_workers, nr_verified, nr_found;
+   int opt;
+   int i;
+
+   while ((opt = getopt(argc, argv, "n:m:d:i:l:H")) != -1) {
+      switch (opt) {
+      case 'n': nr_registrants = atoi(optarg); break;
+      case 'm': nr_readers = atoi(optarg); break;
+      case 'd': seconds = atoi(optarg); break;
+      case 'i': interval_ms = atoi(optarg); break;
+      case 'l': label = optarg; break;
+      case 'H': header = 0; break;
+      default: usage(argv[0]);
+      }
+   }
+   if (nr_registrants < 0 || nr_readers < 0 || seconds <= 0 || interval_ms == 0) {
+      usage(argv[0]);
+   }
+
+   /* workers write straight into memory the parent can see */
+   nr_workers = nr_registrants + nr_readers;
+   shm_size = sizeof(struct shared) + nr_workers * sizeof(struct worker);
+   shm = mmap(NULL, shm_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+              -1, 0);
+   if (shm == MAP_FAILED) {
+      perror("mmap");
+      return 1;
+   }
+   workers = malloc(nr_workers * sizeof(*workers));
+   if (!workers) {
+      return 1;
+   }
+   for (i = 0; i < nr_workers; i++) {
+      workers[i] = &shm->workers[i];
+   }
+
+   for (i = 0; i < nr_workers; i++) {
+      switch (fork()) {
+      case -1:
+         perror("fork");
+         return 1;
+      case 0:
+         if (i < nr_registrants) {
+            registrant(workers[i]);
+         }
+         else {
+            reader(workers[i]);
+         }
+         _exit(0);
+      }
+   }
+
+   /* let everyone go at once */
+   shm->end_ns = now_ns() + seconds * 1000000000ULL;
+   __sync_synchronize();
+   shm->go = 1;
+
+   while (wait(NULL) > 0) {
+      ;
+   }
+   secs = seconds;
+
+   /* check reported totals against getrusage */
+   nr_found = 0;
+   nr_verified = 0;
+   max_err = 0;
+   for (i = 0; i < nr_registrants; i++) {
+      if (!workers[i]->found) {
+         continue;
+      }
+      nr_found++;
+      err = workers[i]->reported_ns > workers[i]->rusage_ns ?
+            workers[i]->reported_ns - workers[i]->rusage_ns :
+            workers[i]->rusage_ns - workers[i]->reported_ns;
+      max_err = err > max_err ? err : max_err;
+      if (err <= VERIFY_SLACK_NS + workers[i]->rusage_ns * VERIFY_PCT / 100) {
+         nr_verified++;
+      }
+   }
+
+   read_bytes = 0;
+   for (i = nr_registrants; i < nr_workers; i++) {
+      read_bytes += workers[i]->bytes;
+   }
+
+   if (header) {
+      printf("label,registrants,readers,seconds,interval_ms,"
+             "reg_ops,reg_ops_s,reg_p50_us,reg_p90_us,reg_p99_us,reg_max_us,"
+             "unreg_ops,unreg_ops_s,unreg_p50_us,unreg_p90_us,unreg_p99_us,unreg_max_us,"
+             "read_ops,read_ops_s,read_p50_us,read_p90_us,read_p99_us,read_max_us,"
+             "read_mb_s,found,verified,max_err_us\n");
+   }
+   printf("%s,%d,%d,%d,%u", label, nr_registrants, nr_readers, seconds,
+          interval_ms);
+   summarize(workers, nr_registrants, offsetof(struct worker, lat), secs);
+   summarize(workers, nr_registrants, offsetof(struct worker, unreg), secs);
+   summarize(workers + nr_registrants, nr_readers, offsetof(struct worker, lat), secs);
+   printf(",%.2f,%d,%d,%.1f\n", read_bytes / secs / (1024 * 1024), nr_found,
+          nr_verified, max_err / 1000.0);
+
+   free(workers);
+   munmap(shm, shm_size);
+
+   return nr_verified == nr_registrants ? 0 : 1;
+}
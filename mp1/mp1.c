@@ -5,259 +5,2170 @@
 #include <linux/fs.h>
 #include <linux/proc_fs.h>
 #include <linux/list.h>
+#include <linux/rculist.h>
+#include <linux/percpu.h>
+#include <linux/cpumask.h>
+#include <linux/rhashtable.h>
 #include <linux/slab.h>
-#include <linux/jiffies.h>
+#include <linux/seq_file.h>
+#include <linux/hrtimer.h>
+#include <linux/timerqueue.h>
 #include <linux/workqueue.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
 #include <linux/spinlock_types.h>
+#include <linux/tracepoint.h>
+#include <linux/string.h>
+#include <linux/sort.h>
+#include <linux/ctype.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/bitmap.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/moduleparam.h>
 #include <asm/uaccess.h>
 
 #include "mp1_given.h"
+#include "mp1_table.h"
 
 #define FILENAME "status"
+#define STATS_FILENAME "stats"
+#define TOP_FILENAME "top"
 #define DIRECTORY "mp1"
 #define RW_PERMISSION 0666                      // allows read, write but not execute
-#define LONG_BUFF_SIZE 21                       // number of digits in ULLONG_MAX + 1
-#define TIMER_PERIOD 5000                       // in msec
+#define RO_PERMISSION 0444                      // allows read only
+#define WRITE_CHUNK_SIZE (64 * 1024)            // largest command batch per write
+#define DECIMAL_BASE 10
+#define MIN_INTERVAL_MS 1                       // finest per-PID sampling interval
+#define CPU_SCALE 10000                         // CPU usage in 1/100 percent
+#define NR_EWMA 3
+#define NR_HIST_BUCKETS 64                      // log2 nsec latency buckets
+#define TOP_MAX_K 256                           // largest top query
+#define EXIT_TRACEPOINT "sched_process_exit"
+#define FORK_TRACEPOINT "sched_process_fork"
+
+/* time_data flags */
+#define MP1_GROUP 0x1                           // aggregates its thread group
+#define MP1_CHILDREN 0x2                        // also follows forked children
+#define MP1_MEMBER 0x4                          // feeds a group, not listed
+#define MP1_LEADER_DEAD 0x8                     // group outlives its own task
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("mesagp2");
 MODULE_DESCRIPTION("CS-423 MP1");
 
-#define DEBUG 0
+#define DEBUG 0
+
+static unsigned int table_size = 4096;
+module_param(table_size, uint, 0444);
+MODULE_PARM_DESC(table_size, "Number of records in the mmap-able lifetime table");
+
+static unsigned int default_interval_ms = 5000;
+module_param(default_interval_ms, uint, 0644);
+MODULE_PARM_DESC(default_interval_ms, "Sampling interval for PIDs registered without one");
+
+static unsigned int pool_size = 0;
+module_param(pool_size, uint, 0444);
+MODULE_PARM_DESC(pool_size, "Entries preallocated for registration and handed out before the entry cache, 0 for none");
+
+static bool lazy = false;
+module_param(lazy, bool, 0444);
+MODULE_PARM_DESC(lazy, "Sample only when status or top is read, no timer");
+
+static unsigned int top_k = 10;
+module_param(top_k, uint, 0444);
+MODULE_PARM_DESC(top_k, "Initial number of PIDs listed in top");
+
+/* ewma_tau_ns - time constants of the 1 s, 10 s and 60 s load averages */
+static const u64 ewma_tau_ns[NR_EWMA] = {
+   1 * NSEC_PER_SEC,
+   10 * NSEC_PER_SEC,
+   60 * NSEC_PER_SEC,
+};
+
+struct mp1_shard;
+
+/* struct time_data - linked list data, also hashed by PID */
+struct time_data {
+   int pid;
+   u64 utime_ns;
+   u64 stime_ns;
+   u64 last_ns;                                 // time of the last sample
+   u64 delta_ns;                                // CPU time used since then
+   u32 cpu;                                     // last sample, CPU_SCALE units
+   u32 ewma[NR_EWMA];                           // CPU_SCALE units
+   int slot;                                    // index in the table, or -1
+   int top_idx;                                 // index in top_heap, or -1
+   unsigned int flags;
+   int tgid;                                    // thread group of a group
+   u64 own_utime_ns;                            // group: its own task's times
+   u64 own_stime_ns;
+   u64 agg_utime_ns;                            // group: members' times
+   u64 agg_stime_ns;
+   struct time_data *group;                     // member: what it feeds
+   struct list_head members;                    // group: its member entries
+   struct list_head member_node;                // member: on group->members
+   int nr_members;
+   u64 interval_ns;                             // per-PID sampling interval
+   struct timerqueue_node due;                  // keyed by next sample time
+   struct mp1_shard *shard;                     // owning shard, fixed
+   bool exited;                                 // retired, waiting to be reaped
+   struct list_head node;                       // RCU, on shard->nodes
+   struct list_head reap;                       // on shard->exited once retired
+   struct rhash_head hash;
+   struct rcu_head rcu;
+};
+
+/* struct mp1_shard - per-CPU slice of the tracked set, registrations go to
+ * the local shard and only the sweep and exit probe touch remote ones */
+struct mp1_shard {
+   spinlock_t lock;                             // writers only, readers use RCU
+   int cpu;
+   struct list_head nodes;                      // every entry, live or exited
+   struct list_head exited;                     // exited, reaped next sweep
+   struct timerqueue_head due_queue;            // live entries by next sample
+};
+
+/* struct tp_lookup - name and result for a tracepoint table search */
+struct tp_lookup {
+   const char *name;
+   struct tracepoint *tp;
+};
+
+/* struct mp1_file - per-open state of the status file */
+struct mp1_file {
+   struct mutex pending_lock;                   // pending, pending_len
+   char *pending;                               // unterminated command tail
+   size_t pending_len;
+   unsigned long seen_gen;                      // sweep_gen at the last read
+   u64 read_start_ns;                           // when seq start took RCU
+   struct time_data *cursor;                    // entry at cursor_pos, where
+   pid_t cursor_pid;                            //   the last chunk stopped
+   loff_t cursor_pos;
+};
+
+/* struct mp1_cmd - one parsed command line, run once its whole write parses */
+struct mp1_cmd {
+   char op;                                     // 'R' or 'U'
+   bool legacy;                                 // bare "pid [interval_ms]"
+   unsigned int interval_ms;
+   unsigned int flags;                          // MP1_GROUP, MP1_CHILDREN
+   int *pids;
+   int nr_pids;
+};
+
+/* struct mp1_cpu_stats - self-instrumentation, summed over CPUs on read */
+struct mp1_cpu_stats {
+   u64 sweeps;
+   u64 sweep_ns;                                // total sweep duration
+   u64 sweep_min_ns;
+   u64 sweep_max_ns;
+   u64 sweep_hist[NR_HIST_BUCKETS];             // sweeps by fls64(duration)
+   u64 visited;                                 // entries sampled or reaped
+   u64 visited_max;                             // most in a single sweep
+   u64 sweep_holds;                             // shard lock acquisitions
+   u64 sweep_hold_ns;
+   u64 sweep_hold_max_ns;
+   u64 reads;                                   // status read chunks
+   u64 read_hold_ns;                            // time inside the read section
+   u64 read_hold_max_ns;
+   u64 registrations;
+   u64 allocs;
+   u64 frees;
+   u64 alloc_fails;
+   u64 pool_misses;                             // pool empty, fell back to the cache
+};
+
+/* struct top_entry - heap element, a copy of what the top file prints */
+struct top_entry {
+   struct time_data *entry;                     // owner, for its top_idx
+   int pid;
+   u32 cpu;
+   u32 ewma[NR_EWMA];
+};
+
+/* struct sweep_tally - what one sweep did, folded into mp1_cpu_stats */
+struct sweep_tally {
+   u64 visited;
+   u64 holds;
+   u64 hold_ns;
+   u64 hold_max_ns;
+};
+
+/* pid_table_params - PID-keyed lookup, shrinks as workers exit */
+static const struct rhashtable_params pid_table_params = {
+   .key_len             = sizeof(int),
+   .key_offset          = offsetof(struct time_data, pid),
+   .head_offset         = offsetof(struct time_data, hash),
+   .automatic_shrinking = true,
+};
+
+static struct mp1_shard __percpu *shards;
+static spinlock_t timer_lock;                   // serializes hrtimer programming
+static bool stopping;                           // unloading, timer_lock, never re-arm
+
+static struct rhashtable pid_table;
+static struct tracepoint *exit_tp;
+static struct tracepoint *fork_tp;
+static struct mp1_table *table;
+static size_t table_bytes;
+static unsigned long *slot_map;                 // used table slots
+static struct hrtimer timer;
+static struct work_struct work;
+
+static struct kmem_cache *time_data_cache;
+static DEFINE_SPINLOCK(pool_lock);              // RCU frees refill from softirq
+static struct time_data **pool_elems;           // NULL unless pool_size > 0
+static unsigned int pool_free;                  // entries left in pool_elems
+
+static DEFINE_PER_CPU(struct mp1_cpu_stats, cpu_stats);
+static u64 load_ns;                             // module load time
+static DEFINE_MUTEX(stats_mutex);               // last_* snapshot below
+static u64 last_stats_ns;
+static u64 last_registrations;
+
+static DEFINE_SPINLOCK(top_lock);               // nests inside shard locks
+static struct top_entry top_heap[TOP_MAX_K];    // min-heap on ewma[0]
+static unsigned int top_len;
+
+static DEFINE_MUTEX(sweep_mutex);               // one sweep at a time
+static unsigned long refresh_gen;               // lazy refreshes completed
+
+static DECLARE_WAIT_QUEUE_HEAD(sweep_wait);     // pollers of the status file
+static atomic_long_t sweep_gen;                 // sweeps that changed data
+
+static struct proc_dir_entry *proc_dir;
+static struct proc_dir_entry *proc_entry;
+static struct proc_dir_entry *table_entry;
+static struct proc_dir_entry *stats_entry;
+static struct proc_dir_entry *top_entry;
+
+/* kvmalloc_buff - kmalloc for small buffers, vmalloc past a page */
+static void *kvmalloc_buff(size_t size) {
+   if (size <= PAGE_SIZE) {
+      return kmalloc(size, GFP_KERNEL);
+   }
+   return vmalloc(size);
+}
+
+/* pool_get - pops a preallocated entry, NULL if the pool is empty or off */
+static struct time_data *pool_get(void) {
+   struct time_data *this_entry = NULL;
+   unsigned long flags;
+
+   if (!pool_elems) {
+      return NULL;
+   }
+
+   spin_lock_irqsave(&pool_lock, flags);
+   if (pool_free > 0) {
+      this_entry = pool_elems[--pool_free];
+   }
+   spin_unlock_irqrestore(&pool_lock, flags);
+
+   if (!this_entry) {
+      this_cpu_inc(cpu_stats.pool_misses);
+   }
+   return this_entry;
+}
+
+/* pool_put - pushes an entry back if the pool has room, returns false if not */
+static bool pool_put(struct time_data *this_entry) {
+   unsigned long flags;
+   bool put = false;
+
+   if (!pool_elems) {
+      return false;
+   }
+
+   spin_lock_irqsave(&pool_lock, flags);
+   if (pool_free < pool_size) {
+      pool_elems[pool_free++] = this_entry;
+      put = true;
+   }
+   spin_unlock_irqrestore(&pool_lock, flags);
+
+   return put;
+}
+
+/* destroy_pool - frees the pool and whatever entries are left in it */
+static void destroy_pool(void) {
+   if (!pool_elems) {
+      return;
+   }
+   while (pool_free > 0) {
+      kmem_cache_free(time_data_cache, pool_elems[--pool_free]);
+   }
+   kfree(pool_elems);
+   pool_elems = NULL;
+}
+
+/* create_pool - preallocates pool_size entries from the entry cache */
+static int create_pool(void) {
+   pool_elems = NULL;
+   pool_free = 0;
+   if (pool_size == 0) {
+      return 0;
+   }
+
+   pool_elems = kcalloc(pool_size, sizeof(*pool_elems), GFP_KERNEL);
+   if (!pool_elems) {
+      return -ENOMEM;
+   }
+   while (pool_free < pool_size) {
+      pool_elems[pool_free] = kmem_cache_alloc(time_data_cache, GFP_KERNEL);
+      if (!pool_elems[pool_free]) {
+         destroy_pool();
+         return -ENOMEM;
+      }
+      pool_free++;
+   }
+
+   return 0;
+}
+
+/* alloc_entry - takes a zeroed entry from the pool, or from the entry cache
+ * once the pool is empty, which pool_misses counts */
+static struct time_data *alloc_entry(gfp_t gfp) {
+   struct time_data *this_entry;
+
+   this_entry = pool_get();
+   if (!this_entry) {
+      this_entry = kmem_cache_alloc(time_data_cache, gfp);
+   }
+   if (!this_entry) {
+      this_cpu_inc(cpu_stats.alloc_fails);
+      return NULL;
+   }
+
+   this_cpu_inc(cpu_stats.allocs);
+   memset(this_entry, 0, sizeof(struct time_data));
+   INIT_LIST_HEAD(&this_entry->members);
+   this_entry->top_idx = -1;
+   return this_entry;
+}
+
+/* free_entry - refills the pool first, the cache gets what doesn't fit */
+static void free_entry(struct time_data *this_entry) {
+   this_cpu_inc(cpu_stats.frees);
+   if (!pool_put(this_entry)) {
+      kmem_cache_free(time_data_cache, this_entry);
+   }
+}
+
+/* free_entry_rcu - frees an entry once RCU readers are done with it */
+static void free_entry_rcu(struct rcu_head *head) {
+   free_entry(container_of(head, struct time_data, rcu));
+}
+
+/* get_cpu_times - like get_cpu_use, but returns utime and stime in nsec */
+static int get_cpu_times(int pid, u64 *utime_ns, u64 *stime_ns) {
+   struct task_struct *task;
+   cputime_t utime, stime;
+
+   rcu_read_lock();
+   task = find_task_by_pid(pid);
+   if (task == NULL) {
+      rcu_read_unlock();
+      return -1;
+   }
+   task_cputime(task, &utime, &stime);
+   rcu_read_unlock();
+
+   *utime_ns = cputime_to_nsecs(utime);
+   *stime_ns = cputime_to_nsecs(stime);
+
+   return 0;
+}
+
+/* get_tgid - returns the thread group of a PID, or the PID if it is gone */
+static int get_tgid(int pid) {
+   struct task_struct *task;
+   int tgid;
+
+   rcu_read_lock();
+   task = find_task_by_pid(pid);
+   tgid = task ? task->tgid : pid;
+   rcu_read_unlock();
+
+   return tgid;
+}
+
+/* write_record - publishes entry times to its table slot, shard lock held */
+static void write_record(struct time_data *this_entry, int pid) {
+   struct mp1_record *rec;
+
+   if (this_entry->slot < 0) {
+      return;
+   }
+   rec = &table->records[this_entry->slot];
+
+   /* odd seq tells readers to retry */
+   WRITE_ONCE(rec->seq, rec->seq + 1);
+   smp_wmb();
+
+   rec->pid = pid;
+   rec->utime = this_entry->utime_ns;
+   rec->stime = this_entry->stime_ns;
+   rec->last_update_ns = this_entry->last_ns;
+
+   smp_wmb();
+   WRITE_ONCE(rec->seq, rec->seq + 1);
+}
+
+/* update_usage - folds a new sample into the entry's rates and averages,
+ * returns true if any reported value changed */
+static bool update_usage(struct time_data *this_entry, u64 utime_ns,
+                         u64 stime_ns, u64 now_ns) {
+   u64 total, prev, dt;
+   u32 old;
+   bool changed;
+   int i;
+
+   total = utime_ns + stime_ns;
+   prev = this_entry->utime_ns + this_entry->stime_ns;
+   dt = now_ns - this_entry->last_ns;
+
+   changed = total != prev || this_entry->delta_ns != 0;
+   this_entry->delta_ns = total > prev ? total - prev : 0;
+   this_entry->utime_ns = utime_ns;
+   this_entry->stime_ns = stime_ns;
+   this_entry->last_ns = now_ns;
+
+   if (dt == 0) {
+      return changed;
+   }
+   old = this_entry->cpu;
+   this_entry->cpu = div64_u64(this_entry->delta_ns * CPU_SCALE, dt);
+   changed |= old != this_entry->cpu;
+
+   /* ewma += (cpu - ewma) * dt / (tau + dt), stable for any interval */
+   for (i = 0; i < NR_EWMA; i++) {
+      old = this_entry->ewma[i];
+      this_entry->ewma[i] = div64_u64(this_entry->ewma[i] * ewma_tau_ns[i] +
+                                      (u64) this_entry->cpu * dt,
+                                      ewma_tau_ns[i] + dt);
+      changed |= old != this_entry->ewma[i];
+   }
+
+   return changed;
+}
+
+/* arm_timer - programs the hrtimer for the earliest due entry of any shard */
+static void arm_timer(void) {
+   struct mp1_shard *shard;
+   struct timerqueue_node *next;
+   ktime_t expires;
+   bool armed;
+   int cpu;
+
+   /* lazy mode samples on read, the timer stays off */
+   if (lazy) {
+      return;
+   }
+
+   spin_lock(&timer_lock);
+   if (stopping) {
+      spin_unlock(&timer_lock);
+      return;
+   }
+
+   /* merge the shards' earliest deadlines */
+   armed = false;
+   expires = KTIME_MAX;
+   for_each_possible_cpu(cpu) {
+      shard = per_cpu_ptr(shards, cpu);
+      spin_lock(&shard->lock);
+      next = timerqueue_getnext(&shard->due_queue);
+      if (next && ktime_before(next->expires, expires)) {
+         expires = next->expires;
+         armed = true;
+      }
+      spin_unlock(&shard->lock);
+   }
+
+   /* nothing tracked, leave the timer disarmed */
+   if (armed) {
+      hrtimer_start(&timer, expires, HRTIMER_MODE_ABS);
+   }
+
+   spin_unlock(&timer_lock);
+}
+
+/* arm_timer_at - pulls the hrtimer in to expires if that is sooner */
+static void arm_timer_at(ktime_t expires) {
+   if (lazy) {
+      return;
+   }
+
+   spin_lock(&timer_lock);
+   if (stopping) {
+      spin_unlock(&timer_lock);
+      return;
+   }
+   if (!hrtimer_is_queued(&timer) ||
+       ktime_before(expires, hrtimer_get_expires(&timer))) {
+      hrtimer_start(&timer, expires, HRTIMER_MODE_ABS);
+   }
+   spin_unlock(&timer_lock);
+}
+
+/* alloc_slot - claims a free table slot for an entry, shard lock held */
+static void alloc_slot(struct time_data *this_entry) {
+   unsigned long slot;
+
+   /* other shards allocate concurrently, retry if we lose the bit */
+   do {
+      slot = find_first_zero_bit(slot_map, table_size);
+      if (slot >= table_size) {
+         /* entries past the end of the table are only listed in status */
+         this_entry->slot = -1;
+         return;
+      }
+   } while (test_and_set_bit(slot, slot_map));
+
+   this_entry->slot = slot;
+   write_record(this_entry, this_entry->pid);
+}
+
+/* free_slot - clears and releases an entry's table slot, shard lock held */
+static void free_slot(struct time_data *this_entry) {
+   if (this_entry->slot < 0) {
+      return;
+   }
+
+   write_record(this_entry, 0);
+   clear_bit(this_entry->slot, slot_map);
+   this_entry->slot = -1;
+}
+
+/* top_swap - exchanges two heap elements and their owners' indices */
+static void top_swap(unsigned int a, unsigned int b) {
+   swap(top_heap[a], top_heap[b]);
+   top_heap[a].entry->top_idx = a;
+   top_heap[b].entry->top_idx = b;
+}
+
+/* top_sift - restores the heap around index i after its key changed */
+static void top_sift(unsigned int i) {
+   unsigned int child;
+
+   while (i > 0 && top_heap[i].ewma[0] < top_heap[(i - 1) / 2].ewma[0]) {
+      top_swap(i, (i - 1) / 2);
+      i = (i - 1) / 2;
+   }
+
+   while ((child = 2 * i + 1) < top_len) {
+      if (child + 1 < top_len &&
+          top_heap[child + 1].ewma[0] < top_heap[child].ewma[0]) {
+         child++;
+      }
+      if (top_heap[i].ewma[0] <= top_heap[child].ewma[0]) {
+         break;
+      }
+      top_swap(i, child);
+      i = child;
+   }
+}
+
+/* top_remove - drops heap element i, top_lock held */
+static void top_remove(unsigned int i) {
+   top_heap[i].entry->top_idx = -1;
+   top_len--;
+   if (i == top_len) {
+      return;
+   }
+
+   top_heap[i] = top_heap[top_len];
+   top_heap[i].entry->top_idx = i;
+   top_sift(i);
+}
+
+/* top_update - offers a freshly sampled entry to the top heap, shard lock
+ * held; entries that drop out are offered again on their next sample */
+static void top_update(struct time_data *this_entry) {
+   struct top_entry *elem;
+   unsigned int i;
+
+   spin_lock(&top_lock);
+
+   if (this_entry->top_idx >= 0) {
+      i = this_entry->top_idx;
+   }
+   else if (top_len < top_k) {
+      i = top_len++;
+   }
+   else if (top_len > 0 && this_entry->ewma[0] > top_heap[0].ewma[0]) {
+      /* evict the lightest */
+      top_heap[0].entry->top_idx = -1;
+      i = 0;
+   }
+   else {
+      spin_unlock(&top_lock);
+      return;
+   }
+
+   elem = &top_heap[i];
+   elem->entry = this_entry;
+   elem->pid = this_entry->pid;
+   elem->cpu = this_entry->cpu;
+   memcpy(elem->ewma, this_entry->ewma, sizeof(elem->ewma));
+   this_entry->top_idx = i;
+   top_sift(i);
+
+   spin_unlock(&top_lock);
+}
+
+/* sample_entry - folds a task's times into its entry, shard lock held;
+ * members pass their growth on to the group, which reports its own task's
+ * times plus everything its members have used */
+static bool sample_entry(struct time_data *this_entry, u64 utime_ns,
+                         u64 stime_ns, u64 now_ns) {
+   struct time_data *group;
+   bool changed;
+
+   if (this_entry->flags & MP1_MEMBER) {
+      group = this_entry->group;
+      if (utime_ns > this_entry->utime_ns) {
+         group->agg_utime_ns += utime_ns - this_entry->utime_ns;
+      }
+      if (stime_ns > this_entry->stime_ns) {
+         group->agg_stime_ns += stime_ns - this_entry->stime_ns;
+      }
+      update_usage(this_entry, utime_ns, stime_ns, now_ns);
+
+      /* members are not listed, the group shows it on its next sample */
+      return false;
+   }
+
+   this_entry->own_utime_ns = utime_ns;
+   this_entry->own_stime_ns = stime_ns;
+   changed = update_usage(this_entry, utime_ns + this_entry->agg_utime_ns,
+                          stime_ns + this_entry->agg_stime_ns, now_ns);
+   write_record(this_entry, this_entry->pid);
+   top_update(this_entry);
+
+   return changed;
+}
+
+/* retire_entry - unhashes an exited entry, shard lock held; a group takes its
+ * members with it, and the last member out takes a group whose task is gone */
+static void retire_entry(struct time_data *this_entry) {
+   struct mp1_shard *shard = this_entry->shard;
+   struct time_data *member, *temp, *group;
+
+   rhashtable_remove_fast(&pid_table, &this_entry->hash, pid_table_params);
+   timerqueue_del(&shard->due_queue, &this_entry->due);
+   this_entry->exited = true;
+   list_add_tail(&this_entry->reap, &shard->exited);
+
+   /* nothing periodic will reap it in lazy mode */
+   if (lazy) {
+      schedule_work(&work);
+   }
+
+   if (this_entry->top_idx >= 0) {
+      spin_lock(&top_lock);
+      top_remove(this_entry->top_idx);
+      spin_unlock(&top_lock);
+   }
+
+   if (this_entry->flags & MP1_MEMBER) {
+      group = this_entry->group;
+      list_del(&this_entry->member_node);
+      group->nr_members--;
+      if (group->nr_members == 0 && (group->flags & MP1_LEADER_DEAD) &&
+          !group->exited) {
+         retire_entry(group);
+      }
+      return;
+   }
+
+   list_for_each_entry_safe(member, temp, &this_entry->members, member_node) {
+      retire_entry(member);
+   }
+}
+
+/* finish_entry - handles the task behind an entry going away, shard lock
+ * held; a group keeps reporting while any of its members still run */
+static void finish_entry(struct time_data *this_entry) {
+   if (this_entry->nr_members > 0) {
+      this_entry->flags |= MP1_LEADER_DEAD;
+      return;
+   }
+
+   retire_entry(this_entry);
+}
+
+/* add_member - hashes and queues a member under its group, shard lock held;
+ * utime_ns and stime_ns are the member's times already counted by the group */
+static int add_member(struct time_data *group, struct time_data *member,
+                      int pid, u64 utime_ns, u64 stime_ns, ktime_t now,
+                      bool *first) {
+   int error;
+
+   member->pid = pid;
+   member->flags = MP1_MEMBER;
+   member->group = group;
+   member->shard = group->shard;
+   member->slot = -1;
+   member->utime_ns = utime_ns;
+   member->stime_ns = stime_ns;
+   member->last_ns = ktime_to_ns(now);
+   member->interval_ns = group->interval_ns;
+   timerqueue_init(&member->due);
+   member->due.expires = ktime_add_ns(now, member->interval_ns);
+
+   error = rhashtable_lookup_insert_fast(&pid_table, &member->hash,
+                                         pid_table_params);
+   if (error) {
+      return error;
+   }
+
+   list_add_tail_rcu(&member->node, &group->shard->nodes);
+   list_add_tail(&member->member_node, &group->members);
+   group->nr_members++;
+   if (timerqueue_add(&group->shard->due_queue, &member->due)) {
+      *first = true;
+   }
+
+   return 0;
+}
+
+/* sample_task - samples one entry's task, shard lock held; returns true if
+ * anything a reader would see changed */
+static bool sample_task(struct time_data *this_entry, ktime_t now) {
+   u64 utime_ns, stime_ns;
+   int res;
+
+   /* a group whose own task is gone only collects from its members */
+   if (this_entry->flags & MP1_LEADER_DEAD) {
+      utime_ns = this_entry->own_utime_ns;
+      stime_ns = this_entry->own_stime_ns;
+      res = 0;
+   }
+   else {
+      res = get_cpu_times(this_entry->pid, &utime_ns, &stime_ns);
+   }
+
+   if (res == 0) {
+      /* process exists, update node data and its record in place */
+      return sample_entry(this_entry, utime_ns, stime_ns, ktime_to_ns(now));
+   }
+
+   /* process doesn't exist, retire it like the exit probe would */
+   finish_entry(this_entry);
+   return true;
+}
+
+/* sweep_shard - reaps one shard, then samples its due entries, or every
+ * entry if sample_all; returns true if anything a reader would see changed */
+static bool sweep_shard(struct mp1_shard *shard, ktime_t now, bool sample_all,
+                        struct sweep_tally *tally) {
+   struct time_data *this_entry, *temp;
+   struct timerqueue_node *next;
+   bool changed;
+   u64 hold_start, hold_ns;
+
+   spin_lock(&shard->lock);
+   hold_start = ktime_get_ns();
+
+   changed = !list_empty(&shard->exited);
+
+   /* reap entries retired since the last sweep, readers may still hold them */
+   list_for_each_entry_safe(this_entry, temp, &shard->exited, reap) {
+      list_del(&this_entry->reap);
+      list_del_rcu(&this_entry->node);
+      free_slot(this_entry);
+      call_rcu(&this_entry->rcu, free_entry_rcu);
+      tally->visited++;
+   }
+
+   /* a read in lazy mode, deadlines don't matter */
+   if (sample_all) {
+      list_for_each_entry(this_entry, &shard->nodes, node) {
+         if (!this_entry->exited) {
+            changed |= sample_task(this_entry, now);
+            tally->visited++;
+         }
+      }
+   }
+
+   /* pop due entries in deadline order, exited tasks are normally gone */
+   while (!lazy && (next = timerqueue_getnext(&shard->due_queue)) &&
+          ktime_compare(next->expires, now) <= 0) {
+
+      this_entry = container_of(next, struct time_data, due);
+      changed |= sample_task(this_entry, now);
+      tally->visited++;
+      if (this_entry->exited) {
+         continue;
+      }
+
+      /* requeue, skipping missed periods rather than bursting */
+      timerqueue_del(&shard->due_queue, next);
+      next->expires = ktime_add_ns(next->expires, this_entry->interval_ns);
+      if (ktime_compare(next->expires, now) <= 0) {
+         next->expires = ktime_add_ns(now, this_entry->interval_ns);
+      }
+      timerqueue_add(&shard->due_queue, next);
+   }
+
+   hold_ns = ktime_get_ns() - hold_start;
+   spin_unlock(&shard->lock);
+
+   tally->holds++;
+   tally->hold_ns += hold_ns;
+   tally->hold_max_ns = max(tally->hold_max_ns, hold_ns);
+
+   return changed;
+}
+
+/* account_sweep - folds one sweep into this CPU's stats */
+static void account_sweep(u64 sweep_ns, struct sweep_tally *tally) {
+   struct mp1_cpu_stats *stats;
+
+   stats = get_cpu_ptr(&cpu_stats);
+
+   if (stats->sweeps == 0 || sweep_ns < stats->sweep_min_ns) {
+      stats->sweep_min_ns = sweep_ns;
+   }
+   stats->sweeps++;
+   stats->sweep_ns += sweep_ns;
+   stats->sweep_max_ns = max(stats->sweep_max_ns, sweep_ns);
+   stats->sweep_hist[min_t(int, fls64(sweep_ns), NR_HIST_BUCKETS - 1)]++;
+
+   stats->visited += tally->visited;
+   stats->visited_max = max(stats->visited_max, tally->visited);
+
+   stats->sweep_holds += tally->holds;
+   stats->sweep_hold_ns += tally->hold_ns;
+   stats->sweep_hold_max_ns = max(stats->sweep_hold_max_ns, tally->hold_max_ns);
+
+   put_cpu_ptr(&cpu_stats);
+}
+
+/* sweep - runs one sweep over every shard, sweep_mutex held */
+static void sweep(bool sample_all) {
+   struct sweep_tally tally = { 0 };
+   ktime_t now;
+   bool changed;
+   int cpu;
+
+   /* one shard lock at a time, registration elsewhere carries on */
+   now = ktime_get();
+   changed = false;
+   for_each_possible_cpu(cpu) {
+      changed |= sweep_shard(per_cpu_ptr(shards, cpu), now, sample_all, &tally);
+   }
+   account_sweep(ktime_get_ns() - ktime_to_ns(now), &tally);
+
+   /* let table readers know a sweep completed */
+   smp_wmb();
+   WRITE_ONCE(table->generation, table->generation + 1);
+
+   /* wake pollers only when there is something new to read */
+   if (changed) {
+      atomic_long_inc(&sweep_gen);
+      wake_up_interruptible(&sweep_wait);
+   }
+}
+
+/* work_callback - handler for workqueue, samples only the entries now due,
+ * or in lazy mode just reaps exited ones */
+static void work_callback(void *data) {
+   mutex_lock(&sweep_mutex);
+   sweep(false);
+   mutex_unlock(&sweep_mutex);
+
+   /* sleep until the next entry is due */
+   arm_timer();
+}
+
+/* refresh - samples everything for a reader in lazy mode; readers that queue
+ * up behind a refresh in progress share its result instead of sweeping again */
+static void refresh(void) {
+   unsigned long gen;
+
+   if (!lazy) {
+      return;
+   }
+
+   gen = READ_ONCE(refresh_gen);
+   mutex_lock(&sweep_mutex);
+   if (refresh_gen == gen) {
+      sweep(true);
+      WRITE_ONCE(refresh_gen, gen + 1);
+   }
+   mutex_unlock(&sweep_mutex);
+}
+
+/* exit_probe - retires a tracked task as soon as it exits */
+static void exit_probe(void *data, struct task_struct *task) {
+   struct time_data *this_entry;
+   cputime_t utime, stime;
+   u64 now_ns;
+
+   /* cheap lockless miss for the many untracked tasks that exit */
+   rcu_read_lock();
+   this_entry = rhashtable_lookup_fast(&pid_table, &task->pid, pid_table_params);
+   if (!this_entry) {
+      rcu_read_unlock();
+      return;
+   }
+
+   /* recheck under the shard lock, the sweep may have raced us; a dead
+    * group leader's PID may already belong to someone else */
+   spin_lock(&this_entry->shard->lock);
+   if (!this_entry->exited && !(this_entry->flags & MP1_LEADER_DEAD)) {
+      /* capture final CPU time, keep it visible until the next sweep */
+      now_ns = ktime_get_ns();
+      task_cputime(task, &utime, &stime);
+      sample_entry(this_entry, cputime_to_nsecs(utime),
+                   cputime_to_nsecs(stime), now_ns);
+      finish_entry(this_entry);
+   }
+   spin_unlock(&this_entry->shard->lock);
+   rcu_read_unlock();
+}
+
+/* fork_probe - adds a thread or child forked inside a tracked group to it,
+ * runs in the forking task so the aggregate never has to walk threads */
+static void fork_probe(void *data, struct task_struct *parent,
+                       struct task_struct *child) {
+   struct time_data *this_entry, *group, *member;
+   struct mp1_shard *shard;
+   ktime_t now, expires;
+   bool first;
+   int error;
+
+   /* cheap lockless miss for the many untracked tasks that fork */
+   rcu_read_lock();
+   this_entry = rhashtable_lookup_fast(&pid_table, &parent->pid,
+                                       pid_table_params);
+   if (!this_entry || (this_entry->flags & MP1_LEADER_DEAD)) {
+      goto out;
+   }
+   group = this_entry->flags & MP1_MEMBER ? this_entry->group : this_entry;
+   if (!(group->flags & MP1_GROUP)) {
+      goto out;
+   }
+   if (child->tgid != group->tgid && !(group->flags & MP1_CHILDREN)) {
+      goto out;
+   }
+
+   /* we can't sleep in fork, the pool covers bursts if one is configured */
+   member = alloc_entry(GFP_ATOMIC);
+   if (!member) {
+      goto out;
+   }
+
+   /* a fresh task has used no CPU yet, so its baseline is zero */
+   now = ktime_get();
+   first = false;
+   shard = group->shard;
+   spin_lock(&shard->lock);
+   error = group->exited ? -ESRCH :
+           add_member(group, member, child->pid, 0, 0, now, &first);
+   expires = member->due.expires;
+   spin_unlock(&shard->lock);
+
+   if (error) {
+      free_entry(member);
+   }
+   else if (first) {
+      arm_timer_at(expires);
+   }
+
+out:
+   rcu_read_unlock();
+}
+
+/* find_tracepoint - for_each_kernel_tracepoint callback matching by name */
+static void find_tracepoint(struct tracepoint *tp, void *priv) {
+   struct tp_lookup *lookup = priv;
+
+   if (!strcmp(tp->name, lookup->name)) {
+      lookup->tp = tp;
+   }
+}
+
+/* timer_callback - handler for hrtimer, fires when the earliest entry is due */
+static enum hrtimer_restart timer_callback(struct hrtimer *hrtimer) {
+
+   /* call work, which re-arms the timer for the next due entry */
+   schedule_work(&work);
+
+   return HRTIMER_NORESTART;
+}
+
+/* first_entry - returns the first entry at or after shard cpu, RCU held */
+static struct time_data *first_entry(int cpu) {
+   struct mp1_shard *shard;
+   struct time_data *this_entry;
+
+   for (; cpu < nr_cpu_ids; cpu = cpumask_next(cpu, cpu_possible_mask)) {
+      shard = per_cpu_ptr(shards, cpu);
+      this_entry = list_first_or_null_rcu(&shard->nodes, struct time_data, node);
+      if (this_entry) {
+         return this_entry;
+      }
+   }
+
+   return NULL;
+}
+
+/* next_entry - returns the entry after this one, crossing shards, RCU held */
+static struct time_data *next_entry(struct time_data *this_entry) {
+   struct mp1_shard *shard = this_entry->shard;
+   struct time_data *next;
+
+   next = list_next_or_null_rcu(&shard->nodes, &this_entry->node,
+                                struct time_data, node);
+   if (next) {
+      return next;
+   }
+
+   return first_entry(cpumask_next(shard->cpu, cpu_possible_mask));
+}
+
+/* seek_cursor - returns the entry the last chunk stopped on if it is at pos
+ * and still tracked, so sequential reads resume instead of rescanning; RCU
+ * held */
+static struct time_data *seek_cursor(struct mp1_file *state, loff_t pos) {
+   struct time_data *this_entry;
+
+   if (!state->cursor || pos != state->cursor_pos) {
+      return NULL;
+   }
+
+   /* still hashed means not retired, so still on its shard's list */
+   this_entry = rhashtable_lookup_fast(&pid_table, &state->cursor_pid,
+                                       pid_table_params);
+   if (this_entry != state->cursor) {
+      return NULL;
+   }
+
+   return this_entry;
+}
+
+/* set_cursor - remembers the entry at pos for the next chunk */
+static void set_cursor(struct mp1_file *state, struct time_data *this_entry,
+                       loff_t pos) {
+   state->cursor = this_entry;
+   state->cursor_pos = pos;
+   if (this_entry) {
+      state->cursor_pid = this_entry->pid;
+   }
+}
+
+/* mp1_seq_start - enters an RCU read section and seeks to the entry at *pos,
+ * from the last chunk's cursor when it still matches */
+static void *mp1_seq_start(struct seq_file *m, loff_t *pos) {
+   struct mp1_file *state = m->private;
+   struct time_data *this_entry;
+   loff_t i;
+
+   /* a read from the top refreshes in lazy mode, and consumes the latest
+    * sweep for poll */
+   if (*pos == 0) {
+      refresh();
+      state->seen_gen = atomic_long_read(&sweep_gen);
+   }
+
+   rcu_read_lock();
+   state->read_start_ns = ktime_get_ns();
+
+   /* fall back to a linear seek after an lseek or a retired cursor */
+   this_entry = seek_cursor(state, *pos);
+   if (!this_entry) {
+      this_entry = first_entry(cpumask_first(cpu_possible_mask));
+      for (i = 0; this_entry && i < *pos; i++) {
+         this_entry = next_entry(this_entry);
+      }
+   }
+   set_cursor(state, this_entry, *pos);
+
+   return this_entry;
+}
+
+/* mp1_seq_next - advances to the next tracked process */
+static void *mp1_seq_next(struct seq_file *m, void *v, loff_t *pos) {
+   struct time_data *this_entry;
+
+   ++*pos;
+   this_entry = next_entry(v);
+   set_cursor(m->private, this_entry, *pos);
+
+   return this_entry;
+}
+
+/* mp1_seq_stop - leaves the RCU read section once a chunk is filled */
+static void mp1_seq_stop(struct seq_file *m, void *v) {
+   struct mp1_file *state = m->private;
+   struct mp1_cpu_stats *stats;
+   u64 hold_ns;
+
+   hold_ns = ktime_get_ns() - state->read_start_ns;
+   rcu_read_unlock();
+
+   stats = get_cpu_ptr(&cpu_stats);
+   stats->reads++;
+   stats->read_hold_ns += hold_ns;
+   stats->read_hold_max_ns = max(stats->read_hold_max_ns, hold_ns);
+   put_cpu_ptr(&cpu_stats);
+}
+
+/* mp1_seq_show - outputs one tracked process as
+ * "pid: utime_ns stime_ns delta_ns cpu% ewma1s% ewma10s% ewma60s%",
+ * group members are only counted in their group's line */
+static int mp1_seq_show(struct seq_file *m, void *v) {
+   struct time_data *this_entry;
+   int i;
+
+   this_entry = v;
+   if (this_entry->flags & MP1_MEMBER) {
+      return SEQ_SKIP;
+   }
+
+   seq_printf(m, "%d: %llu %llu %llu %u.%02u", this_entry->pid,
+              this_entry->utime_ns, this_entry->stime_ns, this_entry->delta_ns,
+              this_entry->cpu / 100, this_entry->cpu % 100);
+   for (i = 0; i < NR_EWMA; i++) {
+      seq_printf(m, " %u.%02u", this_entry->ewma[i] / 100,
+                 this_entry->ewma[i] % 100);
+   }
+   seq_putc(m, '\n');
+
+   return 0;
+}
+
+/* mp1_seq_ops - streams the list one page-sized chunk per read */
+static const struct seq_operations mp1_seq_ops = {
+   .start   = mp1_seq_start,
+   .next    = mp1_seq_next,
+   .stop    = mp1_seq_stop,
+   .show    = mp1_seq_show,
+};
+
+/* mp1_open - attaches a seq_file iterator and write state to each opener */
+static int mp1_open(struct inode *inode, struct file *file) {
+   struct mp1_file *state;
+
+   state = __seq_open_private(file, &mp1_seq_ops, sizeof(struct mp1_file));
+   if (!state) {
+      return -ENOMEM;
+   }
+
+   /* a new opener has not read anything yet */
+   state->seen_gen = atomic_long_read(&sweep_gen) - 1;
+   mutex_init(&state->pending_lock);
 
-/* struct time_data - linked list data */
-struct time_data {
-   int pid;
-   unsigned long lifetime;
-   struct list_head node;
-};
+   return 0;
+}
 
-static spinlock_t list_lock;
+/* mp1_poll - readable once a sweep has changed data since the last read */
+static unsigned int mp1_poll(struct file *file, poll_table *wait) {
+   struct mp1_file *state = ((struct seq_file *) file->private_data)->private;
+   unsigned int mask;
 
-static struct time_data time_list;
-static struct timer_list timer;
-static struct work_struct work;
+   poll_wait(file, &sweep_wait, wait);
 
-static struct proc_dir_entry *proc_dir;
-static struct proc_dir_entry *proc_entry;
+   mask = POLLOUT | POLLWRNORM;
+   if (atomic_long_read(&sweep_gen) != state->seen_gen) {
+      mask |= POLLIN | POLLRDNORM;
+   }
 
-/* work_callback - handler for workqueue, updates process lifetimes */
-static void work_callback(void *data) {
-   struct time_data *this_entry;
-   struct list_head *this_node, *temp;
-   int res;
-   unsigned long cpu_time;
+   return mask;
+}
 
-   /* update list */
-   spin_lock(&list_lock);
-   list_for_each_safe(this_node, temp, &time_list.node) {
+/* add_threads - seeds a newly registered group with the threads it already
+ * has, later ones are added by the fork probe */
+static int add_threads(int pid) {
+   struct task_struct *task, *thread;
+   struct time_data **members;
+   struct time_data *group;
+   struct mp1_shard *shard;
+   cputime_t utime, stime;
+   ktime_t now, expires;
+   bool first;
+   int nr_members;
+   int nr_found;
+   int error;
+   int i;
 
-      this_entry = list_entry(this_node, struct time_data, node);
-      res = get_cpu_use(this_entry->pid, &cpu_time);
+   rcu_read_lock();
+   task = find_task_by_pid(pid);
+   nr_members = task ? get_nr_threads(task) - 1 : 0;
+   rcu_read_unlock();
+   if (nr_members <= 0) {
+      return 0;
+   }
 
-      if (res == 0) {
-         /* process exists, update node data */
-         this_entry->lifetime = cpu_time;
+   /* allocate before walking, threads started since are caught at fork */
+   members = kvmalloc_buff(nr_members * sizeof(*members));
+   if (!members) {
+      return -ENOMEM;
+   }
+   for (i = 0; i < nr_members; i++) {
+      members[i] = alloc_entry(GFP_KERNEL);
+      if (!members[i]) {
+         break;
       }
-      else {
-         /* process doesn't exist, delete node data */
-         list_del(this_node);
-         kfree(this_entry);
+   }
+   nr_members = i;
+
+   /* baseline every other thread, their time so far is seeded into the group */
+   nr_found = 0;
+   rcu_read_lock();
+   task = find_task_by_pid(pid);
+   if (task) {
+      for_each_thread(task, thread) {
+         if (nr_found == nr_members) {
+            break;
+         }
+         if (thread->pid == pid) {
+            continue;
+         }
+         task_cputime(thread, &utime, &stime);
+         members[nr_found]->pid = thread->pid;
+         members[nr_found]->utime_ns = cputime_to_nsecs(utime);
+         members[nr_found]->stime_ns = cputime_to_nsecs(stime);
+         nr_found++;
       }
    }
-   spin_unlock(&list_lock);
-}
+   rcu_read_unlock();
 
-/* timer_callback - handler for periodic timer */
-static void timer_callback(unsigned long data) {
+   /* the group may have exited or been unregistered meanwhile */
+   now = ktime_get();
+   first = false;
+   expires = KTIME_MAX;
+   rcu_read_lock();
+   group = rhashtable_lookup_fast(&pid_table, &pid, pid_table_params);
+   if (group && (group->flags & MP1_GROUP)) {
+      shard = group->shard;
+      spin_lock(&shard->lock);
+      for (i = 0; i < nr_found && !group->exited; i++) {
+         error = add_member(group, members[i], members[i]->pid,
+                            members[i]->utime_ns, members[i]->stime_ns,
+                            now, &first);
+         if (error) {
+            continue;
+         }
 
-   /* call work */
-   schedule_work(&work);
+         /* fold the seed into both sides so the next delta stays honest */
+         group->agg_utime_ns += members[i]->utime_ns;
+         group->agg_stime_ns += members[i]->stime_ns;
+         group->utime_ns += members[i]->utime_ns;
+         group->stime_ns += members[i]->stime_ns;
+         expires = min(expires, members[i]->due.expires);
+         members[i] = NULL;
+      }
+      spin_unlock(&shard->lock);
+   }
+   rcu_read_unlock();
+
+   for (i = 0; i < nr_members; i++) {
+      if (members[i]) {
+         free_entry(members[i]);
+      }
+   }
+   kvfree(members);
+
+   if (first) {
+      arm_timer_at(expires);
+   }
 
-   /* repeat timer */
-   mod_timer(&timer, jiffies + msecs_to_jiffies(TIMER_PERIOD));
+   return 0;
 }
 
-/* mp1_read - outputs tracked process lifetimes */
-static ssize_t mp1_read ( struct file *file, char __user *buffer,
-                           size_t count, loff_t *data ) {
+/* register_batch - samples and inserts a batch of PIDs under one shard lock,
+ * returns the number of PIDs now tracked or a negative error; with MP1_GROUP
+ * each PID reports its whole thread group, and MP1_CHILDREN adds children.
+ * A PID already counted in a group fails the whole batch with -EEXIST,
+ * before anything is inserted */
+static int register_batch(int *pids, int nr_pids, unsigned int interval_ms,
+                          unsigned int flags) {
+   struct time_data **entries;
    struct time_data *this_entry;
-   size_t procfs_buffer_size;
-   char temp_buffer[LONG_BUFF_SIZE];
+   struct time_data *tracked;
+   struct mp1_shard *shard;
+   u64 utime_ns, stime_ns;
+   ktime_t now, expires;
+   bool first;
+   int nr_entries;
+   int nr_tracked;
+   int error;
    int i;
-   char *procfs_buffer;
-   ssize_t res;
 
-   /* allocate procfs_buffer to heap */
-   procfs_buffer = (char *) kmalloc(count, GFP_KERNEL);
+   entries = kvmalloc_buff(nr_pids * sizeof(*entries));
+   if (!entries) {
+      return -ENOMEM;
+   }
 
-   /* load process time data into buffer */
-   procfs_buffer_size = 0;
-   spin_lock(&list_lock);
-   list_for_each_entry(this_entry, &time_list.node, node) {
-      /* convert PID from unsigned to string */
-      sprintf(temp_buffer, "%d", this_entry->pid);
+   /* allocate and baseline every entry up front, unknown PIDs are skipped */
+   now = ktime_get();
+   nr_entries = 0;
+   nr_tracked = 0;
+   for (i = 0; i < nr_pids; i++) {
+      if (get_cpu_times(pids[i], &utime_ns, &stime_ns)) {
+         continue;
+      }
 
-      /* copy PID string into buffer */
-      i = 0;
-      while (temp_buffer[i] != '\0') {
-         procfs_buffer[procfs_buffer_size] = temp_buffer[i];
-         procfs_buffer_size++;
-         i++;
+      /* all or nothing, a batch that can't be allocated inserts none of it */
+      this_entry = alloc_entry(GFP_KERNEL);
+      if (!this_entry) {
+         while (nr_entries > 0) {
+            free_entry(entries[--nr_entries]);
+         }
+         kvfree(entries);
+         return -ENOMEM;
       }
 
-      /* add seperator between PID and CPU time of PID */
-      procfs_buffer[procfs_buffer_size++] = ':';
-      procfs_buffer[procfs_buffer_size++] = ' ';
+      this_entry->pid = pids[i];
+      this_entry->flags = flags;
+      this_entry->tgid = get_tgid(pids[i]);
+      this_entry->utime_ns = utime_ns;
+      this_entry->stime_ns = stime_ns;
+      this_entry->own_utime_ns = utime_ns;
+      this_entry->own_stime_ns = stime_ns;
+      this_entry->last_ns = ktime_to_ns(now);
+      this_entry->interval_ns = (u64) interval_ms * NSEC_PER_MSEC;
+      timerqueue_init(&this_entry->due);
+      this_entry->due.expires = ktime_add_ns(now, this_entry->interval_ns);
+      entries[nr_entries++] = this_entry;
+   }
 
-      /* convert CPU time from unsigned long to string */
-      sprintf(temp_buffer, "%d", (int)(this_entry->lifetime));
+   /* a PID counted in a group never gets a line of its own, so one fails
+    * the whole batch before any of it is inserted; the member may sit in
+    * any shard, RCU keeps it alive while its flags are read */
+   rcu_read_lock();
+   for (i = 0; i < nr_entries; i++) {
+      tracked = rhashtable_lookup_fast(&pid_table, &entries[i]->pid,
+                                       pid_table_params);
+      if (tracked && (tracked->flags & MP1_MEMBER)) {
+         break;
+      }
+   }
+   rcu_read_unlock();
+   if (i < nr_entries) {
+      for (i = 0; i < nr_entries; i++) {
+         free_entry(entries[i]);
+      }
+      kvfree(entries);
+      return -EEXIST;
+   }
 
-      /* copy CPU time into buffer */
-      i = 0;
-      while (temp_buffer[i] != '\0') {
-         procfs_buffer[procfs_buffer_size] = temp_buffer[i];
-         procfs_buffer_size++;
-         i++;
+   /* add to the local shard, migrating afterwards is harmless */
+   shard = raw_cpu_ptr(shards);
+   first = false;
+   expires = KTIME_MAX;
+
+   /* add to table and list, re-registering a tracked PID is a no-op */
+   spin_lock(&shard->lock);
+   for (i = 0; i < nr_entries; i++) {
+      this_entry = entries[i];
+      this_entry->shard = shard;
+      error = rhashtable_lookup_insert_fast(&pid_table, &this_entry->hash,
+                                            pid_table_params);
+      if (error == -EEXIST) {
+         /* already tracked, freed below */
+         nr_tracked++;
+         continue;
+      }
+      else if (error) {
+         continue;
       }
 
-      /* add new line */
-      procfs_buffer[procfs_buffer_size++] = '\n';
+      list_add_tail_rcu(&this_entry->node, &shard->nodes);
+      alloc_slot(this_entry);
+      if (timerqueue_add(&shard->due_queue, &this_entry->due)) {
+         first = true;
+         expires = this_entry->due.expires;
+      }
+      entries[i] = NULL;
+      nr_tracked++;
    }
-   spin_unlock(&list_lock);
+   spin_unlock(&shard->lock);
 
-   /* copy buffer to user space */
-   res = simple_read_from_buffer(buffer, count, data, procfs_buffer, procfs_buffer_size);
+   if (nr_tracked > 0) {
+      this_cpu_add(cpu_stats.registrations, nr_tracked);
+   }
 
-   /* free buffer from heap */
-   kfree(procfs_buffer);
+   /* free entries that were not inserted */
+   for (i = 0; i < nr_entries; i++) {
+      if (entries[i]) {
+         free_entry(entries[i]);
+      }
+   }
+   kvfree(entries);
 
-   return res;
+   /* re-arm if the batch holds the shard's earliest due, or the first */
+   if (first) {
+      arm_timer_at(expires);
+   }
+
+   /* groups are hashed now, so the fork probe covers threads from here on */
+   if ((flags & MP1_GROUP) && nr_entries > 0) {
+      for (i = 0; i < nr_pids; i++) {
+         error = add_threads(pids[i]);
+         if (error) {
+            return error;
+         }
+      }
+   }
+
+   return nr_tracked;
 }
 
-/* mp1_write - registers input PID to have its lifetime tracked */
-static ssize_t mp1_write ( struct file *file, const char __user *buffer,
-                           size_t count, loff_t *data ) {
+/* unregister_batch - retires a batch of tracked PIDs */
+static void unregister_batch(int *pids, int nr_pids) {
    struct time_data *this_entry;
-   char procfs_buffer[LONG_BUFF_SIZE];
-   size_t procfs_buffer_size;
+   int i;
+
+   for (i = 0; i < nr_pids; i++) {
+      rcu_read_lock();
+      this_entry = rhashtable_lookup_fast(&pid_table, &pids[i], pid_table_params);
+      if (this_entry) {
+         spin_lock(&this_entry->shard->lock);
+         if (!this_entry->exited) {
+            retire_entry(this_entry);
+         }
+         spin_unlock(&this_entry->shard->lock);
+      }
+      rcu_read_unlock();
+   }
+}
+
+/* parse_line - parses one "R [@interval_ms] [+group|+children] pid...",
+ * "U pid..." or legacy "pid [interval_ms]" command line into cmd, running
+ * nothing; a blank line parses to a command without PIDs */
+static int parse_line(char *line, struct mp1_cmd *cmd) {
+   char *token;
+   int nr_args;
    int error;
-   ssize_t res;
-   int temp_pid;
 
-   /* startup timer if inactive */
-   if (!timer_pending(&timer)) {
-      mod_timer(&timer, jiffies + msecs_to_jiffies(TIMER_PERIOD));
+   cmd->op = 'R';
+   cmd->pids = NULL;
+   cmd->nr_pids = 0;
+   cmd->interval_ms = default_interval_ms;
+   cmd->flags = 0;
+   cmd->legacy = false;
+
+   line = skip_spaces(line);
+   if (*line == '\0') {
+      return 0;
+   }
+
+   /* every PID takes at least two characters including its separator */
+   cmd->pids = kvmalloc_buff((strlen(line) / 2 + 1) * sizeof(int));
+   if (!cmd->pids) {
+      return -ENOMEM;
+   }
+
+   /* legacy single registration, anything past the interval is an error */
+   if (isdigit(*line)) {
+      cmd->legacy = true;
+      nr_args = 0;
+      while ((token = strsep(&line, " \t")) != NULL) {
+         if (*token == '\0') {
+            continue;
+         }
+         if (nr_args == 0) {
+            error = kstrtoint(token, DECIMAL_BASE, &cmd->pids[0]);
+         }
+         else if (nr_args == 1) {
+            error = kstrtouint(token, DECIMAL_BASE, &cmd->interval_ms);
+         }
+         else {
+            error = -EINVAL;
+         }
+         if (error) {
+            return error;
+         }
+         nr_args++;
+      }
+      cmd->nr_pids = 1;
+      return 0;
+   }
+
+   cmd->op = *line++;
+   if (cmd->op != 'R' && cmd->op != 'U') {
+      return -EINVAL;
+   }
+
+   /* collect PIDs, "@ms" and "+flag" apply to the whole line */
+   error = 0;
+   while (!error && (token = strsep(&line, " \t")) != NULL) {
+      if (*token == '\0') {
+         continue;
+      }
+      if (*token == '@') {
+         error = kstrtouint(token + 1, DECIMAL_BASE, &cmd->interval_ms);
+      }
+      else if (!strcmp(token, "+group")) {
+         cmd->flags |= MP1_GROUP;
+      }
+      else if (!strcmp(token, "+children")) {
+         cmd->flags |= MP1_GROUP | MP1_CHILDREN;
+      }
+      else if (*token == '+') {
+         error = -EINVAL;
+      }
+      else {
+         error = kstrtoint(token, DECIMAL_BASE, &cmd->pids[cmd->nr_pids++]);
+      }
    }
 
-   /* copy buffer into kernel space */
-   procfs_buffer_size = count;
-   if (procfs_buffer_size > LONG_BUFF_SIZE) {
-      procfs_buffer_size = LONG_BUFF_SIZE;
+   return error;
+}
+
+/* run_cmd - applies one parsed command */
+static int run_cmd(struct mp1_cmd *cmd) {
+   unsigned int interval_ms;
+   int res;
+
+   if (cmd->nr_pids == 0) {
+      return 0;
+   }
+   if (cmd->op == 'U') {
+      unregister_batch(cmd->pids, cmd->nr_pids);
+      return 0;
    }
-   res = simple_write_to_buffer( procfs_buffer,
-                                 LONG_BUFF_SIZE,
-                                 data,
-                                 buffer,
-                                 procfs_buffer_size );
+
+   interval_ms = max_t(unsigned int, cmd->interval_ms, MIN_INTERVAL_MS);
+   res = register_batch(cmd->pids, cmd->nr_pids, interval_ms, cmd->flags);
    if (res < 0) {
       return res;
    }
+   /* the legacy format always expected its one PID to exist */
+   return cmd->legacy && res == 0 ? -ESRCH : 0;
+}
+
+/* run_lines - parses every complete line in buff and, only if all of them
+ * parse, runs them in order, stopping at the first that fails; the
+ * unterminated tail is returned for the next write or close */
+static int run_lines(char *buff, char **tail) {
+   struct mp1_cmd *cmds;
+   char *line;
+   char *p;
+   int nr_cmds;
+   int nr_lines;
+   int error;
+   int i;
+
+   nr_lines = 0;
+   for (p = buff; (p = strchr(p, '\n')) != NULL; p++) {
+      nr_lines++;
+   }
+
+   *tail = NULL;
+   if (nr_lines == 0) {
+      *tail = buff;
+      return 0;
+   }
+
+   cmds = kvmalloc_buff(nr_lines * sizeof(*cmds));
+   if (!cmds) {
+      return -ENOMEM;
+   }
+
+   /* parse the whole batch before any of it takes effect */
+   error = 0;
+   nr_cmds = 0;
+   while (!error && nr_cmds < nr_lines) {
+      line = strsep(&buff, "\n");
+      error = parse_line(line, &cmds[nr_cmds++]);
+   }
+
+   for (i = 0; !error && i < nr_cmds; i++) {
+      error = run_cmd(&cmds[i]);
+   }
+
+   for (i = 0; i < nr_cmds; i++) {
+      kvfree(cmds[i].pids);
+   }
+   kvfree(cmds);
+
+   if (!error) {
+      *tail = buff;
+   }
+   return error;
+}
+
+/* mp1_write - runs a batch of newline separated registration commands */
+static ssize_t mp1_write ( struct file *file, const char __user *buffer,
+                           size_t count, loff_t *data ) {
+   struct mp1_file *state = ((struct seq_file *) file->private_data)->private;
+   char *procfs_buffer;
+   size_t procfs_buffer_size;
+   size_t copy_size;
+   char *tail;
+   int error;
+
+   /* threads sharing the descriptor, and flush from a dup, take turns */
+   mutex_lock(&state->pending_lock);
+
+   /* stdio may split lines across writes, prepend the carried tail */
+   copy_size = min_t(size_t, count, WRITE_CHUNK_SIZE);
+   procfs_buffer_size = state->pending_len + copy_size;
+
+   procfs_buffer = kvmalloc_buff(procfs_buffer_size + 1);
+   if (!procfs_buffer) {
+      error = -ENOMEM;
+      goto out;
+   }
+   memcpy(procfs_buffer, state->pending, state->pending_len);
+   if (copy_from_user(procfs_buffer + state->pending_len, buffer, copy_size)) {
+      error = -EFAULT;
+      goto out;
+   }
 
    /* fix string to terminate */
    procfs_buffer[procfs_buffer_size] = '\0';
 
-   /* set pid */
-   error = kstrtol(procfs_buffer, 10, (long*) &temp_pid);
-   if (error) {
-      return error;
+   /* run whole lines, then carry the tail */
+   error = run_lines(procfs_buffer, &tail);
+   kvfree(state->pending);
+   state->pending = NULL;
+   state->pending_len = 0;
+   if (!error && tail && strlen(tail) > WRITE_CHUNK_SIZE) {
+      /* one line longer than a chunk */
+      error = -E2BIG;
+   }
+   else if (!error && tail && *tail != '\0') {
+      state->pending_len = strlen(tail);
+      state->pending = kvmalloc_buff(state->pending_len);
+      if (state->pending) {
+         memcpy(state->pending, tail, state->pending_len);
+      }
+      else {
+         state->pending_len = 0;
+         error = -ENOMEM;
+      }
    }
 
-   /* create struct to track process's uptime */
-   this_entry = (struct time_data*) kmalloc(sizeof(struct time_data), GFP_KERNEL);
+out:
+   mutex_unlock(&state->pending_lock);
+   kvfree(procfs_buffer);
+
+   return error ? error : copy_size;
+}
 
-   /* add to list */
-   spin_lock(&list_lock);
-   list_add(&(this_entry->node), &(time_list.node));
-   spin_unlock(&list_lock);
+/* mp1_flush - runs a final command written without a newline, its error is
+ * what close() returns */
+static int mp1_flush(struct file *file, fl_owner_t id) {
+   struct mp1_file *state = ((struct seq_file *) file->private_data)->private;
+   char *procfs_buffer;
+   char *tail;
+   int error;
 
-   /* set attributes */
-   this_entry->lifetime = 0;
-   this_entry->pid = temp_pid;
+   mutex_lock(&state->pending_lock);
+   if (state->pending_len == 0) {
+      mutex_unlock(&state->pending_lock);
+      return 0;
+   }
 
-   return res;
+   /* a newline makes it an ordinary one-line batch */
+   procfs_buffer = kvmalloc_buff(state->pending_len + 2);
+   if (procfs_buffer) {
+      memcpy(procfs_buffer, state->pending, state->pending_len);
+      procfs_buffer[state->pending_len] = '\n';
+      procfs_buffer[state->pending_len + 1] = '\0';
+      error = run_lines(procfs_buffer, &tail);
+      kvfree(procfs_buffer);
+   }
+   else {
+      error = -ENOMEM;
+   }
+
+   kvfree(state->pending);
+   state->pending = NULL;
+   state->pending_len = 0;
+   mutex_unlock(&state->pending_lock);
+   return error;
+}
+
+/* mp1_release - frees the per-open state along with the seq_file */
+static int mp1_release(struct inode *inode, struct file *file) {
+   struct mp1_file *state = ((struct seq_file *) file->private_data)->private;
+
+   kvfree(state->pending);
+   return seq_release_private(inode, file);
 }
 
-/* mp1_fops - stores links read and write functions to mp1 file */
+/* mp1_fops - stores links to seq_file read and write functions for mp1 file */
 static const struct file_operations mp1_fops = {
    .owner   = THIS_MODULE,
-   .read    = mp1_read,
+   .open    = mp1_open,
+   .read    = seq_read,
+   .llseek  = seq_lseek,
    .write   = mp1_write,
+   .poll    = mp1_poll,
+   .flush   = mp1_flush,
+   .release = mp1_release,
+};
+
+/* hist_percentile - upper bound of the bucket holding the pct-th percentile */
+static u64 hist_percentile(const u64 *hist, u64 total, unsigned int pct) {
+   u64 rank, seen;
+   int i;
+
+   if (total == 0) {
+      return 0;
+   }
+
+   rank = div64_u64(total * pct + 99, 100);
+   seen = 0;
+   for (i = 0; i < NR_HIST_BUCKETS - 1; i++) {
+      seen += hist[i];
+      if (seen >= rank) {
+         break;
+      }
+   }
+
+   /* bucket i holds durations below 2^i nsec */
+   return i == 0 ? 0 : (1ULL << i) - 1;
+}
+
+/* stats_show - sums the per-CPU counters, mostly for sizing and overhead */
+static int stats_show(struct seq_file *m, void *v) {
+   struct mp1_cpu_stats sum, *stats;
+   u64 now_ns, regs_rate, load_rate;
+   int cpu;
+   int i;
+
+   /* racy against concurrent updates, which is fine for monitoring */
+   memset(&sum, 0, sizeof(sum));
+   for_each_possible_cpu(cpu) {
+      stats = per_cpu_ptr(&cpu_stats, cpu);
+      if (stats->sweeps &&
+          (sum.sweeps == 0 || stats->sweep_min_ns < sum.sweep_min_ns)) {
+         sum.sweep_min_ns = stats->sweep_min_ns;
+      }
+      sum.sweeps += stats->sweeps;
+      sum.sweep_ns += stats->sweep_ns;
+      sum.sweep_max_ns = max(sum.sweep_max_ns, stats->sweep_max_ns);
+      for (i = 0; i < NR_HIST_BUCKETS; i++) {
+         sum.sweep_hist[i] += stats->sweep_hist[i];
+      }
+      sum.visited += stats->visited;
+      sum.visited_max = max(sum.visited_max, stats->visited_max);
+      sum.sweep_holds += stats->sweep_holds;
+      sum.sweep_hold_ns += stats->sweep_hold_ns;
+      sum.sweep_hold_max_ns = max(sum.sweep_hold_max_ns, stats->sweep_hold_max_ns);
+      sum.reads += stats->reads;
+      sum.read_hold_ns += stats->read_hold_ns;
+      sum.read_hold_max_ns = max(sum.read_hold_max_ns, stats->read_hold_max_ns);
+      sum.registrations += stats->registrations;
+      sum.allocs += stats->allocs;
+      sum.frees += stats->frees;
+      sum.alloc_fails += stats->alloc_fails;
+      sum.pool_misses += stats->pool_misses;
+   }
+
+   /* registration rate since module load and since the last stats read */
+   now_ns = ktime_get_ns();
+   load_rate = div64_u64(sum.registrations * NSEC_PER_SEC,
+                         max_t(u64, now_ns - load_ns, 1));
+   mutex_lock(&stats_mutex);
+   regs_rate = div64_u64((sum.registrations - last_registrations) * NSEC_PER_SEC,
+                         max_t(u64, now_ns - last_stats_ns, 1));
+   last_registrations = sum.registrations;
+   last_stats_ns = now_ns;
+   mutex_unlock(&stats_mutex);
+
+   seq_printf(m, "sweeps: %llu\n", sum.sweeps);
+   seq_printf(m, "sweep_ns_min: %llu\n", sum.sweep_min_ns);
+   seq_printf(m, "sweep_ns_avg: %llu\n",
+              sum.sweeps ? div64_u64(sum.sweep_ns, sum.sweeps) : 0);
+   seq_printf(m, "sweep_ns_max: %llu\n", sum.sweep_max_ns);
+   seq_printf(m, "sweep_ns_p99: %llu\n",
+              hist_percentile(sum.sweep_hist, sum.sweeps, 99));
+   seq_printf(m, "visited_avg: %llu\n",
+              sum.sweeps ? div64_u64(sum.visited, sum.sweeps) : 0);
+   seq_printf(m, "visited_max: %llu\n", sum.visited_max);
+   seq_printf(m, "sweep_hold_ns_avg: %llu\n",
+              sum.sweep_holds ? div64_u64(sum.sweep_hold_ns, sum.sweep_holds) : 0);
+   seq_printf(m, "sweep_hold_ns_max: %llu\n", sum.sweep_hold_max_ns);
+   seq_printf(m, "read_hold_ns_avg: %llu\n",
+              sum.reads ? div64_u64(sum.read_hold_ns, sum.reads) : 0);
+   seq_printf(m, "read_hold_ns_max: %llu\n", sum.read_hold_max_ns);
+   seq_printf(m, "registrations: %llu\n", sum.registrations);
+   seq_printf(m, "registrations_per_sec: %llu\n", regs_rate);
+   seq_printf(m, "registrations_per_sec_avg: %llu\n", load_rate);
+   seq_printf(m, "allocs: %llu\n", sum.allocs);
+   seq_printf(m, "frees: %llu\n", sum.frees);
+   seq_printf(m, "in_use: %lld\n", (s64) (sum.allocs - sum.frees));
+   seq_printf(m, "alloc_fails: %llu\n", sum.alloc_fails);
+   seq_printf(m, "pool_size: %u\n", pool_elems ? pool_size : 0);
+   seq_printf(m, "pool_free: %u\n", READ_ONCE(pool_free));
+   seq_printf(m, "pool_misses: %llu\n", sum.pool_misses);
+
+   return 0;
+}
+
+/* stats_open - stats is small, render it in one go */
+static int stats_open(struct inode *inode, struct file *file) {
+   return single_open(file, stats_show, NULL);
+}
+
+/* stats_fops - read-only counters */
+static const struct file_operations stats_fops = {
+   .owner   = THIS_MODULE,
+   .open    = stats_open,
+   .read    = seq_read,
+   .llseek  = seq_lseek,
+   .release = single_release,
+};
+
+/* top_cmp - sort() comparator, heaviest first */
+static int top_cmp(const void *a, const void *b) {
+   const struct top_entry *x = a, *y = b;
+
+   if (x->ewma[0] != y->ewma[0]) {
+      return x->ewma[0] < y->ewma[0] ? 1 : -1;
+   }
+   return x->pid - y->pid;
+}
+
+/* top_show - outputs the heaviest PIDs by 1 s average as
+ * "pid: cpu% ewma1s% ewma10s% ewma60s%", copied out of the heap */
+static int top_show(struct seq_file *m, void *v) {
+   struct top_entry *top;
+   unsigned int nr_top;
+   unsigned int i;
+   int j;
+
+   top = kmalloc_array(TOP_MAX_K, sizeof(*top), GFP_KERNEL);
+   if (!top) {
+      return -ENOMEM;
+   }
+
+   refresh();
+
+   /* copy K elements, sort outside the lock */
+   spin_lock(&top_lock);
+   nr_top = top_len;
+   memcpy(top, top_heap, nr_top * sizeof(*top));
+   spin_unlock(&top_lock);
+
+   sort(top, nr_top, sizeof(*top), top_cmp, NULL);
+
+   for (i = 0; i < nr_top; i++) {
+      seq_printf(m, "%d: %u.%02u", top[i].pid, top[i].cpu / 100,
+                 top[i].cpu % 100);
+      for (j = 0; j < NR_EWMA; j++) {
+         seq_printf(m, " %u.%02u", top[i].ewma[j] / 100, top[i].ewma[j] % 100);
+      }
+      seq_putc(m, '\n');
+   }
+
+   kfree(top);
+   return 0;
+}
+
+/* top_open - top is at most TOP_MAX_K lines, render it in one go */
+static int top_open(struct inode *inode, struct file *file) {
+   return single_open(file, top_show, NULL);
+}
+
+/* top_write - sets K, shrinking the heap at once if it got smaller */
+static ssize_t top_write(struct file *file, const char __user *buffer,
+                         size_t count, loff_t *data) {
+   unsigned int k;
+   int error;
+
+   error = kstrtouint_from_user(buffer, count, DECIMAL_BASE, &k);
+   if (error) {
+      return error;
+   }
+   if (k == 0 || k > TOP_MAX_K) {
+      return -EINVAL;
+   }
+
+   spin_lock(&top_lock);
+   top_k = k;
+   while (top_len > top_k) {
+      top_remove(0);
+   }
+   spin_unlock(&top_lock);
+
+   return count;
+}
+
+/* top_fops - read the heaviest PIDs, write K */
+static const struct file_operations top_fops = {
+   .owner   = THIS_MODULE,
+   .open    = top_open,
+   .read    = seq_read,
+   .write   = top_write,
+   .llseek  = seq_lseek,
+   .release = single_release,
 };
 
+/* table_mmap - maps the lifetime table read-only into the caller */
+static int table_mmap(struct file *file, struct vm_area_struct *vma) {
+   if (vma->vm_flags & VM_WRITE) {
+      return -EPERM;
+   }
+   vma->vm_flags &= ~VM_MAYWRITE;
+
+   return remap_vmalloc_range(vma, table, vma->vm_pgoff);
+}
+
+/* table_fops - the table file only supports mmap */
+static const struct file_operations table_fops = {
+   .owner   = THIS_MODULE,
+   .mmap    = table_mmap,
+};
+
+/* alloc_table - allocates and formats the mmap-able lifetime table */
+static int alloc_table(void) {
+   table_bytes = PAGE_ALIGN(sizeof(struct mp1_table) +
+                            table_size * sizeof(struct mp1_record));
+
+   /* zeroed and suitable for remap_vmalloc_range */
+   table = vmalloc_user(table_bytes);
+   if (!table) {
+      return -ENOMEM;
+   }
+
+   slot_map = kcalloc(BITS_TO_LONGS(table_size), sizeof(unsigned long),
+                      GFP_KERNEL);
+   if (!slot_map) {
+      vfree(table);
+      return -ENOMEM;
+   }
+
+   table->magic = MP1_TABLE_MAGIC;
+   table->version = MP1_TABLE_VERSION;
+   table->nr_records = table_size;
+   table->record_size = sizeof(struct mp1_record);
+
+   return 0;
+}
+
+/* free_table - releases the lifetime table */
+static void free_table(void) {
+   kfree(slot_map);
+   vfree(table);
+}
+
 /* mp1_init - called when module is loaded */
 static int __init mp1_init(void)
 {
+   struct tp_lookup lookup = { .name = EXIT_TRACEPOINT, .tp = NULL };
+   struct mp1_shard *shard;
+   int res;
+   int cpu;
+
    #ifdef DEBUG
    printk(KERN_ALERT "MP1 MODULE LOADING\n");
    #endif
 
-   /* init spinlock */
-   spin_lock_init(&list_lock);
+   /* init timer spinlock */
+   spin_lock_init(&timer_lock);
+
+   /* init sweep generation for pollers */
+   atomic_long_set(&sweep_gen, 0);
+
+   /* stats rates are measured from load */
+   load_ns = ktime_get_ns();
+
+   /* top heap is sized statically */
+   top_k = clamp_t(unsigned int, top_k, 1, TOP_MAX_K);
+   top_len = 0;
+   last_stats_ns = load_ns;
+   last_registrations = 0;
 
    /* init work */
    INIT_WORK(&work, (work_func_t) work_callback);
 
-   /* init process time list */
-   INIT_LIST_HEAD(&time_list.node);
+   /* init entry cache, and the preallocated pool if asked for */
+   time_data_cache = kmem_cache_create("mp1_time_data", sizeof(struct time_data),
+                                       0, 0, NULL);
+   if (!time_data_cache) {
+      return -ENOMEM;
+   }
+   res = create_pool();
+   if (res) {
+      goto err_cache;
+   }
+
+   /* init per-CPU shards of the process time list */
+   shards = alloc_percpu(struct mp1_shard);
+   if (!shards) {
+      res = -ENOMEM;
+      goto err_pool;
+   }
+   for_each_possible_cpu(cpu) {
+      shard = per_cpu_ptr(shards, cpu);
+      spin_lock_init(&shard->lock);
+      shard->cpu = cpu;
+      INIT_LIST_HEAD(&shard->nodes);
+      INIT_LIST_HEAD(&shard->exited);
+      timerqueue_init_head(&shard->due_queue);
+   }
+
+   /* init binary lifetime table */
+   res = alloc_table();
+   if (res) {
+      goto err_shards;
+   }
+
+   /* init PID lookup table */
+   res = rhashtable_init(&pid_table, &pid_table_params);
+   if (res) {
+      goto err_table;
+   }
+
+   /* hook process exit so entries are retired immediately */
+   for_each_kernel_tracepoint(find_tracepoint, &lookup);
+   if (!lookup.tp) {
+      res = -ENOENT;
+      goto err_hash;
+   }
+   res = tracepoint_probe_register(lookup.tp, exit_probe, NULL);
+   if (res) {
+      goto err_hash;
+   }
+   exit_tp = lookup.tp;
+
+   /* hook fork so groups pick up new threads and children as they start */
+   lookup.name = FORK_TRACEPOINT;
+   lookup.tp = NULL;
+   for_each_kernel_tracepoint(find_tracepoint, &lookup);
+   if (!lookup.tp) {
+      res = -ENOENT;
+      goto err_probe;
+   }
+   res = tracepoint_probe_register(lookup.tp, fork_probe, NULL);
+   if (res) {
+      goto err_probe;
+   }
+   fork_tp = lookup.tp;
 
-   /* init timer */
-   init_timer(&timer);
-   setup_timer(&timer, timer_callback, 0);
+   /* init timer for the shards' due queues */
+   hrtimer_init(&timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+   timer.function = timer_callback;
 
    /* make directory */
    proc_dir = proc_mkdir(DIRECTORY, NULL);
    if (!proc_dir) {
-      return -ENOMEM;
+      res = -ENOMEM;
+      goto err_fork_probe;
    }
 
-   /* make entry */
+   /* make entries */
    proc_entry = proc_create(FILENAME, RW_PERMISSION, proc_dir, &mp1_fops);
    if (!proc_entry) {
-      return -ENOMEM;
+      res = -ENOMEM;
+      goto err_dir;
+   }
+   table_entry = proc_create(MP1_TABLE_FILENAME, RO_PERMISSION, proc_dir,
+                             &table_fops);
+   if (!table_entry) {
+      res = -ENOMEM;
+      goto err_entry;
+   }
+   proc_set_size(table_entry, table_bytes);
+   stats_entry = proc_create(STATS_FILENAME, RO_PERMISSION, proc_dir,
+                             &stats_fops);
+   if (!stats_entry) {
+      res = -ENOMEM;
+      goto err_table_entry;
+   }
+   top_entry = proc_create(TOP_FILENAME, RW_PERMISSION, proc_dir, &top_fops);
+   if (!top_entry) {
+      res = -ENOMEM;
+      goto err_stats_entry;
    }
    
    printk(KERN_ALERT "MP1 MODULE LOADED\n");
    
    return 0;
+
+err_stats_entry:
+   remove_proc_entry(STATS_FILENAME, proc_dir);
+err_table_entry:
+   remove_proc_entry(MP1_TABLE_FILENAME, proc_dir);
+err_entry:
+   remove_proc_entry(FILENAME, proc_dir);
+err_dir:
+   remove_proc_entry(DIRECTORY, NULL);
+err_fork_probe:
+   tracepoint_probe_unregister(fork_tp, fork_probe, NULL);
+err_probe:
+   tracepoint_probe_unregister(exit_tp, exit_probe, NULL);
+   tracepoint_synchronize_unregister();
+err_hash:
+   rhashtable_destroy(&pid_table);
+err_table:
+   free_table();
+err_shards:
+   free_percpu(shards);
+err_pool:
+   destroy_pool();
+err_cache:
+   kmem_cache_destroy(time_data_cache);
+   return res;
 }
 
 /* mp1_exit - called when module is unloaded */
 static void __exit mp1_exit(void)
 {
-   struct time_data *this_entry;
-   struct list_head *this_node, *temp;
+   struct time_data *this_entry, *temp;
+   struct mp1_shard *shard;
+   int cpu;
 
    #ifdef DEBUG
    printk(KERN_ALERT "MP1 MODULE UNLOADING\n");
    #endif
 
-   /* delete timer */
-   del_timer(&timer);
+   /* stop probes and wait for running ones to finish */
+   tracepoint_probe_unregister(fork_tp, fork_probe, NULL);
+   tracepoint_probe_unregister(exit_tp, exit_probe, NULL);
+   tracepoint_synchronize_unregister();
 
-   /* flush global workqueue */
-   flush_scheduled_work();
-   
-   /* remove proc files */
+   /* remove proc files so no new registration can arm the timer */
+   remove_proc_entry(TOP_FILENAME, proc_dir);
+   remove_proc_entry(STATS_FILENAME, proc_dir);
+   remove_proc_entry(MP1_TABLE_FILENAME, proc_dir);
    remove_proc_entry(FILENAME, proc_dir);
    remove_proc_entry(DIRECTORY, NULL);
 
-   /* clear linked list of process time data */
-   list_for_each_safe(this_node, temp, &time_list.node) {
-      this_entry = list_entry(this_node, struct time_data, node);
-      list_del(this_node);
-      kfree(this_entry);
+   /* keep work from re-arming the timer, then stop the timer, the work it
+    * may have queued, and the timer again in case one raced the flag */
+   spin_lock(&timer_lock);
+   stopping = true;
+   spin_unlock(&timer_lock);
+   hrtimer_cancel(&timer);
+   cancel_work_sync(&work);
+   hrtimer_cancel(&timer);
+
+   /* clear every shard of process time data */
+   for_each_possible_cpu(cpu) {
+      shard = per_cpu_ptr(shards, cpu);
+      list_for_each_entry_safe(this_entry, temp, &shard->nodes, node) {
+         if (!this_entry->exited) {
+            rhashtable_remove_fast(&pid_table, &this_entry->hash,
+                                   pid_table_params);
+         }
+         list_del(&this_entry->node);
+         free_entry(this_entry);
+      }
    }
+   rhashtable_destroy(&pid_table);
+
+   /* wait out entries still queued for free_entry_rcu */
+   rcu_barrier();
+
+   free_table();
+   free_percpu(shards);
+   destroy_pool();
+   kmem_cache_destroy(time_data_cache);
 
    printk(KERN_ALERT "MP1 MODULE UNLOADED\n");
 }
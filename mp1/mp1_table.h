@@ -0,0 +1,57 @@
+#ifndef __MP1_TABLE_INCLUDE__
+#define __MP1_TABLE_INCLUDE__
+
+#include <linux/types.h>
+
+#define MP1_TABLE_FILENAME "table"
+#define MP1_TABLE_MAGIC 0x5431504d              // "MP1T" little endian
+#define MP1_TABLE_VERSION 1
+
+/* struct mp1_record - one tracked process, seq is odd while being written */
+struct mp1_record {
+   __u32 seq;
+   __s32 pid;                                   // 0 when the slot is free
+   __u64 utime;                                 // in nsec
+   __u64 stime;                                 // in nsec
+   __u64 last_update_ns;                        // CLOCK_MONOTONIC
+};
+
+/* struct mp1_table - layout of /proc/mp1/table as seen through mmap */
+struct mp1_table {
+   __u32 magic;
+   __u32 version;
+   __u32 nr_records;
+   __u32 record_size;
+   __u64 generation;                            // bumped after every sweep
+   __u64 reserved;
+   struct mp1_record records[];
+};
+
+#ifndef __KERNEL__
+
+/* mp1_read_record - copies a consistent snapshot of a record, no syscalls */
+static inline void mp1_read_record(const volatile struct mp1_record *rec,
+                                   struct mp1_record *out) {
+   __u32 seq;
+
+   do {
+      /* wait out a writer in progress */
+      while ((seq = rec->seq) & 1) {
+         ;
+      }
+      __sync_synchronize();
+
+      out->pid = rec->pid;
+      out->utime = rec->utime;
+      out->stime = rec->stime;
+      out->last_update_ns = rec->last_update_ns;
+
+      __sync_synchronize();
+   } while (rec->seq != seq);
+
+   out->seq = seq;
+}
+
+#endif
+
+#endif
@@ -20,7 +20,7 @@ int main(int argc, char* argv[])
 
    if (proc_file != NULL) {
       /* write to mp1 file */
-      res = fprintf(proc_file, "%d", pid);
+      res = fprintf(proc_file, "%d\n", pid);
       if (res < 0) {
          return res;
       }
@@ -0,0 +1,36 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "libmp2.h"
+
+int mp2_open(void) {
+    return open(MP2_DEVICE, O_RDWR);
+}
+
+int mp2_register(int fd, unsigned int period_us, unsigned int runtime_us) {
+    struct mp2_params reg;
+
+    reg.period_us = period_us;
+    reg.runtime_us = runtime_us;
+
+    return ioctl(fd, MP2_IOC_REGISTER, &reg);
+}
+
+int mp2_yield(int fd) {
+    return ioctl(fd, MP2_IOC_YIELD);
+}
+
+int mp2_deregister(int fd) {
+    return ioctl(fd, MP2_IOC_DEREGISTER);
+}
+
+int mp2_get_stats(int fd, int pid, struct mp2_stats *stats) {
+    stats->pid = pid;
+
+    return ioctl(fd, MP2_IOC_STATS, stats);
+}
+
+int mp2_close(int fd) {
+    return close(fd);
+}
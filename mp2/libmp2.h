@@ -0,0 +1,26 @@
+#ifndef __LIBMP2_INCLUDE__
+#define __LIBMP2_INCLUDE__
+
+#include "mp2_ioctl.h"
+
+/* every call returns 0 on success, or -1 with errno set */
+
+/* mp2_open - opens the mp2 device, returns a descriptor for the calls below */
+int mp2_open(void);
+
+/* mp2_register - registers the calling task with a period and a runtime */
+int mp2_register(int fd, unsigned int period_us, unsigned int runtime_us);
+
+/* mp2_yield - ends the calling task's job, sleeping until its next period */
+int mp2_yield(int fd);
+
+/* mp2_deregister - removes the calling task from the scheduler */
+int mp2_deregister(int fd);
+
+/* mp2_get_stats - fills stats for pid, or for the calling task if pid is 0 */
+int mp2_get_stats(int fd, int pid, struct mp2_stats *stats);
+
+/* mp2_close - closes the descriptor from mp2_open */
+int mp2_close(int fd);
+
+#endif
@@ -7,19 +7,44 @@
 #include <linux/sched.h>
 #include <linux/slab.h>
 #include <linux/list.h>
+#include <linux/rbtree.h>
+#include <linux/hashtable.h>
 #include <linux/mutex.h>
 #include <linux/uaccess.h>
 #include <linux/kthread.h>
-#include <linux/jiffies.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/llist.h>
+#include <linux/atomic.h>
+#include <linux/string.h>
+#include <linux/moduleparam.h>
+#include <linux/percpu.h>
+#include <linux/cpumask.h>
+#include <linux/seq_file.h>
+#include <linux/cdev.h>
+#include <linux/device.h>
+#include <linux/compat.h>
 
 #include "mp2_given.h"
+#include "mp2_ioctl.h"
+
+#define CREATE_TRACE_POINTS
+#include "mp2_trace.h"
 
 #define FILENAME "status"
+#define STATS_FILENAME "stats"
 #define DIRECTORY "mp2"
 #define RW_PERMISSION 0666                      // allows read, write but not execute
+#define READ_PERMISSION 0444
 #define BUFF_SIZE 128
 #define DECIMAL_BASE 10
-#define LN2 693
+#define PPM 1000000ULL                          // utilization fixed point
+#define PID_HASH_BITS 8
+#define US_PER_MS 1000
+#define CDEV_NAME "mp2"
+#define CDEV_COUNT 1
+#define DISPATCH_PRIO (MAX_RT_PRIO - 1)         // dispatchers preempt any task
+#define TASK_PRIO (MAX_RT_PRIO - 2)             // the dispatched task
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("mesagp2");
@@ -27,97 +52,335 @@ MODULE_DESCRIPTION("CS-423 MP2");
 
 // #define DEBUG 1
 
+static bool edf = false;
+module_param(edf, bool, 0444);
+MODULE_PARM_DESC(edf, "Dispatch earliest deadline first instead of rate monotonic");
+
+static unsigned int rta_max_iter = 64;
+module_param(rta_max_iter, uint, 0444);
+MODULE_PARM_DESC(rta_max_iter, "Response-time iterations per task before RMS admission gives up");
+
+static bool worst_fit = false;
+module_param(worst_fit, bool, 0444);
+MODULE_PARM_DESC(worst_fit, "Place tasks on the least loaded CPU instead of the first that fits");
+
+static bool enforce_budget = true;
+module_param(enforce_budget, bool, 0444);
+MODULE_PARM_DESC(enforce_budget, "Stop a job that runs longer than its declared runtime");
+
+static bool overrun_signal = false;
+module_param(overrun_signal, bool, 0444);
+MODULE_PARM_DESC(overrun_signal, "Send SIGXCPU on overrun instead of demoting until the next period");
+
+struct mp2_cpu;
+
+/* enum task_state - SLEEPING until the wakeup timer moves it to RELEASED, which
+ * only the dispatcher turns into READY; the budget timer moves a RUNNING task
+ * to EXHAUSTED, and a demoted one stays THROTTLED until its period ends */
+enum task_state { READY, RUNNING, SLEEPING, RELEASED, EXHAUSTED, THROTTLED };
+
 struct mp2_task_struct {
-	struct task_struct *linux_task;
-    struct timer_list wakeup_timer;
-    struct list_head list;
-    pid_t pid;
-    unsigned long period;
-    unsigned long runtime_ms;
-    unsigned long deadline_jiff;
-    enum task_state { READY, RUNNING, SLEEPING } state;
+	struct task_struct *linux_task;             // referenced while registered
+    struct hrtimer wakeup_timer;
+    struct hrtimer budget_timer;                // armed while dispatched
+    struct list_head list;                      // on its CPU's proc_list
+    struct llist_node release_node;             // on release_queue while RELEASED
+    struct rb_node ready_node;                  // on ready_queue while READY or RUNNING
+    struct hlist_node hash_node;                // on pid_table, by linux_task->pid
+    struct mp2_cpu *mcpu;                       // partition the task is pinned to
+    pid_t pid;                                  // as registered, for output
+    unsigned long period_us;
+    unsigned long runtime_us;
+    ktime_t deadline;                           // absolute, 0 before the first yield
+    u64 response_us;                            // RMS response time, a lower bound
+    u64 new_response_us;                        // scratch for admission
+    atomic_t state;                             // enum task_state
+    u64 budget_ns;                              // left in the current job
+    ktime_t run_start;                          // last dispatch, for charging
+    bool overrun;                               // current job ran out of budget
+    bool throttled;                             // demoted until its period ends
+    struct mp2_stats stats;                     // CPU lock, pid is filled on copy out
 };
 
-static unsigned acrs; // admission control ratio sum
+/* struct mp2_cpu - one partition, tasks never leave the CPU they are
+ * admitted to so each CPU schedules alone */
+struct mp2_cpu {
+	struct mutex lock;                          // everything below but the release queue
+	int cpu;
+	struct mp2_task_struct proc_list;           // RMS order, for admission
+	u64 util_ppm;                               // admitted utilization, each task rounded up
+	struct rb_root ready_queue;                 // runnable tasks, highest priority first
+	struct mp2_task_struct *running_task;
+	struct task_struct *dispatch_thread;        // NULL if the CPU was offline at load
+	struct llist_head release_queue;            // released jobs, filled locklessly by timers
+	atomic_t kicked;                            // a pass is owed, survives wakes while running
+};
 
-static struct mp2_task_struct *running_task;
-static struct task_struct *dispatch_thread;
+static DEFINE_PER_CPU(struct mp2_cpu, mp2_cpus);
 
-static struct mutex list_mutex;
-static struct mp2_task_struct proc_list;
+static struct mutex list_mutex;                 // pid_table and task placement
+static DEFINE_HASHTABLE(pid_table, PID_HASH_BITS);
 
 static struct proc_dir_entry *procfs_dir;
 static struct proc_dir_entry *procfs_entry;
+static struct proc_dir_entry *stats_entry;
 
-/* set_proc_state - sets target process to target state */
-static void set_proc_state(pid_t pid, enum task_state state) {
+static struct cdev mp2_cdev;
+static dev_t device_num;
+static struct class *mp2_class;
+
+/* find_task - looks up a registered task by its task_struct, keyed on the
+ * global PID so no namespace lookup is needed; registered tasks are
+ * referenced, so a match is never a reused pointer; list_mutex held */
+static struct mp2_task_struct *find_task(struct task_struct *task) {
 	struct mp2_task_struct *this_task;
 
-	/* enter critical section */
-	mutex_lock(&list_mutex);
+	hash_for_each_possible(pid_table, this_task, hash_node, task->pid) {
+		if (this_task->linux_task == task) {
+			return this_task;
+		}
+	}
+
+	return NULL;
+}
 
-	/* find process by PID and set state to READY */
-	list_for_each_entry(this_task, &proc_list.list, list) {
+/* find_task_pid - looks up a registered task by the PID it was listed under,
+ * which still works once the task itself is gone; list_mutex held */
+static struct mp2_task_struct *find_task_pid(pid_t pid) {
+	struct mp2_task_struct *this_task;
+	int bkt;
+
+	hash_for_each(pid_table, bkt, this_task, hash_node) {
 		if (this_task->pid == pid) {
-			this_task->state = state;
+			return this_task;
 		}
 	}
 
-	/* exit critical section */
-	mutex_unlock(&list_mutex);
+	return NULL;
+}
+
+/* get_task_by_pid - looks up a PID in the caller's namespace and takes a
+ * reference on its task, NULL if there is none */
+static struct task_struct *get_task_by_pid(pid_t pid) {
+	struct task_struct *task;
+
+	rcu_read_lock();
+	task = get_pid_task(find_vpid(pid), PIDTYPE_PID);
+	rcu_read_unlock();
+
+	return task;
+}
+
+/* job_deadline - absolute deadline of a task's current job, which was
+ * released at task->deadline */
+static ktime_t job_deadline(struct mp2_task_struct *task) {
+	return ktime_add_us(task->deadline, task->period_us);
+}
+
+/* rms_before - RMS priority order, shorter period first, ties broken by PID */
+static bool rms_before(struct mp2_task_struct *a, struct mp2_task_struct *b) {
+	if (a->period_us != b->period_us) {
+		return a->period_us < b->period_us;
+	}
+	return a->pid < b->pid;
+}
+
+/* task_before - dispatch order, earliest job deadline first under EDF, RMS
+ * order otherwise */
+static bool task_before(struct mp2_task_struct *a, struct mp2_task_struct *b) {
+	if (edf && job_deadline(a) != job_deadline(b)) {
+		return ktime_before(job_deadline(a), job_deadline(b));
+	}
+	return rms_before(a, b);
+}
+
+/* ready_enqueue - adds a task to its CPU's ready queue if absent, CPU lock held */
+static void ready_enqueue(struct mp2_task_struct *task) {
+	struct rb_node **link, *parent;
+
+	if (!RB_EMPTY_NODE(&task->ready_node)) {
+		return;
+	}
+
+	/* walk down to the insertion point */
+	link = &task->mcpu->ready_queue.rb_node;
+	parent = NULL;
+	while (*link) {
+		parent = *link;
+		if (task_before(task, rb_entry(parent, struct mp2_task_struct, ready_node))) {
+			link = &parent->rb_left;
+		}
+		else {
+			link = &parent->rb_right;
+		}
+	}
+
+	rb_link_node(&task->ready_node, parent, link);
+	rb_insert_color(&task->ready_node, &task->mcpu->ready_queue);
 }
 
-/* dispatch_func - callback for kernel thread responsible for context switch */
+/* ready_dequeue - removes a task from its CPU's ready queue if present, CPU lock held */
+static void ready_dequeue(struct mp2_task_struct *task) {
+	if (RB_EMPTY_NODE(&task->ready_node)) {
+		return;
+	}
+
+	rb_erase(&task->ready_node, &task->mcpu->ready_queue);
+	RB_CLEAR_NODE(&task->ready_node);
+}
+
+/* release_jobs - moves tasks whose timers fired onto the ready queue,
+ * CPU lock held */
+static void release_jobs(struct mp2_cpu *mcpu) {
+	struct mp2_task_struct *this_task, *next;
+	struct llist_node *released;
+
+	/* take the whole queue at once, oldest release first */
+	released = llist_reverse_order(llist_del_all(&mcpu->release_queue));
+
+	llist_for_each_entry_safe(this_task, next, released, release_node) {
+		atomic_set(&this_task->state, READY);
+
+		/* a throttled job carries on with the next period's budget */
+		if (this_task->throttled) {
+			this_task->throttled = false;
+			this_task->overrun = false;
+			this_task->budget_ns = this_task->runtime_us * NSEC_PER_USEC;
+		}
+		else {
+			this_task->stats.released++;
+		}
+		ready_enqueue(this_task);
+	}
+}
+
+/* kick_dispatcher - asks a CPU's dispatching thread for another pass; a wake
+ * that lands while it is still running would be lost, the flag isn't */
+static void kick_dispatcher(struct mp2_cpu *mcpu) {
+	atomic_set(&mcpu->kicked, 1);
+	wake_up_process(mcpu->dispatch_thread);
+}
+
+/* charge_budget - stops a dispatched task's budget timer and takes the time it
+ * ran off its budget, CPU lock held */
+static void charge_budget(struct mp2_task_struct *task) {
+	ktime_t now;
+	u64 ran;
+
+	/* the callback never takes a lock, so waiting for it is safe */
+	hrtimer_cancel(&task->budget_timer);
+
+	now = ktime_get();
+	ran = ktime_to_ns(ktime_sub(now, task->run_start));
+	task->budget_ns -= min(task->budget_ns, ran);
+	task->run_start = now;
+}
+
+/* overrun - applies the overrun policy to a task whose budget ran out, CPU
+ * lock held */
+static void overrun(struct mp2_task_struct *task) {
+	task->overrun = true;
+	task->stats.overruns++;
+	trace_mp2_job_overrun(task->pid, task->mcpu->cpu, task->deadline);
+
+	/* keep its place, but it runs unbudgeted until it yields */
+	if (overrun_signal) {
+		atomic_set(&task->state, READY);
+		send_sig(SIGXCPU, task->linux_task, 1);
+		return;
+	}
+
+	/* off the ready queue, the dispatcher demotes it on switch out and the
+	 * wakeup timer gives it back when the period ends */
+	ready_dequeue(task);
+	task->throttled = true;
+	atomic_set(&task->state, THROTTLED);
+	hrtimer_start(&task->wakeup_timer, job_deadline(task), HRTIMER_MODE_ABS);
+}
+
+/* dispatch_func - callback for a CPU's kernel thread responsible for context
+ * switch, bound to that CPU and running above the tasks it dispatches */
 static int dispatch_func(void *data) {
-	struct mp2_task_struct *task, *highest_task;
+	struct mp2_cpu *mcpu = data;
+	struct mp2_task_struct *highest_task;
+	struct rb_node *first;
 	struct sched_param sparam;
 
 	/* prime kthread to sleep */
 	set_current_state(TASK_INTERRUPTIBLE);
 	
 	while (!kthread_should_stop()) {
-		/* sleep and wait to wake */
-		schedule();
+		/* sleep and wait to wake, unless kicked since the last pass; the
+		 * state is set before the check so a kick after it wakes us */
+		if (!atomic_xchg(&mcpu->kicked, 0)) {
+			schedule();
+			set_current_state(TASK_INTERRUPTIBLE);
+			continue;
+		}
+		__set_current_state(TASK_RUNNING);
 
 		/* kernel thread wakes up here */
+		trace_mp2_dispatcher_wakeup(mcpu->cpu);
 
 		/* enter critical section */
-		mutex_lock(&list_mutex);
-
-		/* search for READY task with highest priority */
-		highest_task = NULL;
-		list_for_each_entry(task, &proc_list.list, list) {
-			if ((task->state == READY || task->state == RUNNING) &&
-				(highest_task == NULL || task->period < highest_task->period)) {
-				highest_task = task;
+		mutex_lock(&mcpu->lock);
+
+		/* queue jobs the timers released since we last ran */
+		release_jobs(mcpu);
+
+		/* stop charging the running task, it may have just run out */
+		if (mcpu->running_task != NULL) {
+			charge_budget(mcpu->running_task);
+			if (atomic_read(&mcpu->running_task->state) == EXHAUSTED) {
+				overrun(mcpu->running_task);
 			}
 		}
 
+		/* READY or RUNNING task with highest priority is leftmost */
+		first = rb_first(&mcpu->ready_queue);
+		highest_task = first ? rb_entry(first, struct mp2_task_struct, ready_node)
+							 : NULL;
+
 		/* context switch */
 
+		trace_mp2_dispatch(mcpu->cpu, mcpu->running_task ? mcpu->running_task->pid : 0,
+						   highest_task ? highest_task->pid : 0);
+
 		/* switch out of preempted task */
-		if (running_task != NULL) {
+		if (mcpu->running_task != NULL) {
 			/* if current task was preempted, return to READY */
-			if (running_task->state == RUNNING) {
-				running_task->state = READY;
+			if (atomic_cmpxchg(&mcpu->running_task->state, RUNNING, READY) == RUNNING &&
+				mcpu->running_task != highest_task) {
+				trace_mp2_preempt(mcpu->cpu, mcpu->running_task->pid,
+								  highest_task ? highest_task->pid : 0);
 			}
 
 			sparam.sched_priority = 0;
-			sched_setscheduler(running_task->linux_task, SCHED_NORMAL, &sparam);
-			running_task = NULL;
+			sched_setscheduler(mcpu->running_task->linux_task, SCHED_NORMAL,
+							   &sparam);
+			mcpu->running_task = NULL;
 		}
 
 		/* if a READY task exists and is, switch to it */
 		if (highest_task != NULL) {
-			highest_task->state = RUNNING;
+			atomic_set(&highest_task->state, RUNNING);
+			mcpu->running_task = highest_task;
+
+			/* an overrun job isn't charged again until its next release */
+			highest_task->run_start = ktime_get();
+			if (enforce_budget && !highest_task->overrun) {
+				hrtimer_start(&highest_task->budget_timer,
+							  ns_to_ktime(highest_task->budget_ns), HRTIMER_MODE_REL);
+			}
+
+			/* boost last, below our own priority so we can still preempt it */
 			wake_up_process(highest_task->linux_task);
-			sparam.sched_priority = 99;
+			sparam.sched_priority = TASK_PRIO;
 			sched_setscheduler(highest_task->linux_task, SCHED_FIFO, &sparam);
-			running_task = highest_task;
 		}
 
 		/* exit critical section */
-		mutex_unlock(&list_mutex);
+		mutex_unlock(&mcpu->lock);
 
 		/* prime kthread to sleep */
 		set_current_state(TASK_INTERRUPTIBLE);
@@ -129,13 +392,54 @@ static int dispatch_func(void *data) {
 	return 0;
 }
 
-/* wakeup_timer_func - callback that READY's task and wakes dispatching thread */
-static void wakeup_timer_func(unsigned long pid) {
-	/* set process state to READY */
-	set_proc_state((pid_t) pid, READY);
+/* wakeup_timer_func - callback that releases a task's next job and wakes the
+ * dispatching thread, which READY's it; never blocks or takes a lock */
+static enum hrtimer_restart wakeup_timer_func(struct hrtimer *timer) {
+	struct mp2_task_struct *this_task;
+	struct mp2_cpu *mcpu;
 
-	/* wake dispatching thread */
-	wake_up_process(dispatch_thread);
+	this_task = container_of(timer, struct mp2_task_struct, wakeup_timer);
+	mcpu = this_task->mcpu;
+
+	/* the state claims the node, so a task is queued at most once */
+	if (atomic_cmpxchg(&this_task->state, SLEEPING, RELEASED) == SLEEPING) {
+		trace_mp2_job_release(this_task->pid, mcpu->cpu, this_task->deadline);
+	}
+	/* a throttled task's period ended, it isn't a new job */
+	else if (atomic_cmpxchg(&this_task->state, THROTTLED, RELEASED) != THROTTLED) {
+		return HRTIMER_NORESTART;
+	}
+
+	/* only the first release since the last drain needs to wake the
+	 * dispatching thread, later ones are picked up by the same drain */
+	if (llist_add(&this_task->release_node, &mcpu->release_queue)) {
+		kick_dispatcher(mcpu);
+	}
+
+	return HRTIMER_NORESTART;
+}
+
+/* budget_timer_func - callback for a dispatched task that used its runtime,
+ * flags it for the dispatching thread which applies the policy */
+static enum hrtimer_restart budget_timer_func(struct hrtimer *timer) {
+	struct mp2_task_struct *this_task;
+
+	this_task = container_of(timer, struct mp2_task_struct, budget_timer);
+
+	/* a task that yielded or was switched out meanwhile is left alone */
+	if (atomic_cmpxchg(&this_task->state, RUNNING, EXHAUSTED) == RUNNING) {
+		kick_dispatcher(this_task->mcpu);
+	}
+
+	return HRTIMER_NORESTART;
+}
+
+/* format_us - prints a time in ms, or in us if it isn't a whole ms */
+static int format_us(char *buff, size_t count, unsigned long us) {
+	if (us % US_PER_MS == 0) {
+		return snprintf(buff, count, "%lu", us / US_PER_MS);
+	}
+	return snprintf(buff, count, "%luus", us);
 }
 
 /* get_proc_params - reads proc params into buff, returns bytes read */
@@ -143,6 +447,7 @@ static int get_proc_params(char *buff, size_t count) {
 	struct mp2_task_struct *pcb;
 	loff_t pos;
 	int res;
+	int cpu;
 	int i;
 
 	/* initialize position to beginning of buffer */
@@ -152,9 +457,10 @@ static int get_proc_params(char *buff, size_t count) {
 	/* enter critical section */
 	mutex_lock(&list_mutex);
 
-	/* iterate through each process */
+	/* iterate through each process, CPU by CPU */
 	i = 0;
-	list_for_each_entry(pcb, &proc_list.list, list) {
+	for_each_possible_cpu(cpu)
+	list_for_each_entry(pcb, &per_cpu(mp2_cpus, cpu).proc_list.list, list) {
 		i++;
 		/* convert PID to string and insert into buffer */
 		res = snprintf(buff + pos, count - pos, "%d", pcb->pid);
@@ -172,7 +478,7 @@ static int get_proc_params(char *buff, size_t count) {
 		buff[pos++] = ' ';
 
 		/* convert period to string and insert into buffer */
-		res = snprintf(buff + pos, count - pos, "%lu", pcb->period);
+		res = format_us(buff + pos, count - pos, pcb->period_us);
 		if (res < 0) {
 			/* return with error */
 			return res;
@@ -187,7 +493,7 @@ static int get_proc_params(char *buff, size_t count) {
 		buff[pos++] = ' ';
 
 		/* convert processing time to string and insert into buffer */
-		res = snprintf(buff + pos, count - pos, "%lu", pcb->runtime_ms);
+		res = format_us(buff + pos, count - pos, pcb->runtime_us);
 		if (res < 0) {
 			/* return with error */
 			return res;
@@ -258,109 +564,451 @@ static size_t get_next_arg(char *buff, char *arg_buff, loff_t *pos) {
 	return arg_size;
 }
 
-/* init_pcb - creates an augmented PCB */
-static struct mp2_task_struct* init_pcb( pid_t pid, unsigned long period,
-										 unsigned long processing_time ) {
-	struct task_struct *pcb;
-	struct mp2_task_struct *aug_pcb;
+/* parse_us - parses a time given in ms, or in us with a "us" suffix */
+static int parse_us(char *arg, unsigned long *us) {
+	size_t len;
+	int error;
 
-	/* get the userapp's task_struct */
-	pcb = find_task_by_pid(pid);
+	len = strlen(arg);
+	if (len > 2 && !strcmp(arg + len - 2, "us")) {
+		arg[len - 2] = '\0';
+		return kstrtoul(arg, DECIMAL_BASE, us);
+	}
+	if (len > 2 && !strcmp(arg + len - 2, "ms")) {
+		arg[len - 2] = '\0';
+	}
+
+	error = kstrtoul(arg, DECIMAL_BASE, us);
+	if (error) {
+		return error;
+	}
+	*us *= US_PER_MS;
+
+	return 0;
+}
+
+/* init_pcb - creates an augmented PCB for the userapp's task_struct */
+static struct mp2_task_struct* init_pcb( struct task_struct *pcb, pid_t pid,
+										 unsigned long period_us,
+										 unsigned long runtime_us ) {
+	struct mp2_task_struct *aug_pcb;
 
 	/* allocate cache for PCB */
-	aug_pcb = (struct mp2_task_struct*) kmalloc( sizeof(struct mp2_task_struct),
+	aug_pcb = (struct mp2_task_struct*) kzalloc( sizeof(struct mp2_task_struct),
 												 GFP_KERNEL );
+	if (aug_pcb == NULL) {
+		return NULL;
+	}
 
-	/* init task members */
+	/* init task members, the task can't be freed while registered */
+	get_task_struct(pcb);
 	aug_pcb->linux_task = pcb;
 	aug_pcb->pid = pid;
-	aug_pcb->period = period;
-	aug_pcb->runtime_ms = processing_time;
-	aug_pcb->state = SLEEPING;
-	aug_pcb->deadline_jiff = 0;
-	setup_timer(&(aug_pcb->wakeup_timer), wakeup_timer_func, pid);
+	aug_pcb->period_us = period_us;
+	aug_pcb->runtime_us = runtime_us;
+	atomic_set(&aug_pcb->state, SLEEPING);
+	aug_pcb->budget_ns = runtime_us * NSEC_PER_USEC;
+	aug_pcb->deadline = 0;
+	RB_CLEAR_NODE(&aug_pcb->ready_node);
+	hrtimer_init(&aug_pcb->wakeup_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	aug_pcb->wakeup_timer.function = wakeup_timer_func;
+	hrtimer_init(&aug_pcb->budget_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	aug_pcb->budget_timer.function = budget_timer_func;
 
 	return aug_pcb;
 }
 
-/* dereg_task - de-registers task by PID */
-static void dereg_task(pid_t pid) {
-	struct mp2_task_struct *this_task;
-	struct list_head *this_node, *temp;
+/* free_pcb - frees an augmented PCB and drops its task reference */
+static void free_pcb(struct mp2_task_struct *aug_pcb) {
+	put_task_struct(aug_pcb->linux_task);
+	kfree(aug_pcb);
+}
 
-    /* enter critical section */
-    mutex_lock(&list_mutex);
+/* task_util_ppm - utilization of a task in ppm, rounded up so sums never
+ * over-admit */
+static u64 task_util_ppm(struct mp2_task_struct *task) {
+	return DIV_ROUND_UP_ULL((u64) task->runtime_us * PPM, task->period_us);
+}
 
-    /* iterate through tasks */
-    list_for_each_safe(this_node, temp, &proc_list.list) {
+/* hyperbolic_ok - Bini's bound, prod(U_i + 1) <= 2 is sufficient for RMS and
+ * looser than Liu & Layland; CPU lock held */
+static bool hyperbolic_ok(struct mp2_cpu *mcpu) {
+	struct mp2_task_struct *task;
+	u64 prod;
+
+	prod = PPM;
+	list_for_each_entry(task, &mcpu->proc_list.list, list) {
+		prod = DIV_ROUND_UP_ULL(prod * (PPM + task_util_ppm(task)), PPM);
+		if (prod > 2 * PPM) {
+			return false;
+		}
+	}
 
-        /* get task */
-        this_task = list_entry(this_node, struct mp2_task_struct, list);
+	return true;
+}
 
-        /* delete task with matching pid */
-        if (this_task->pid == pid) {
-			/* subtract this task from cumulative sum */
-			acrs -= (1000 * this_task->runtime_ms) / this_task->period;
+/* response_time - iterates R = C + sum ceil(R / T_j) C_j over the tasks ahead
+ * of this one on its CPU, returns true if R settles within the period; the
+ * last known R is a valid start since adding tasks only makes it grow */
+static bool response_time(struct mp2_cpu *mcpu, struct mp2_task_struct *task) {
+	struct mp2_task_struct *hp;
+	u64 r, next;
+	unsigned int i;
+
+	r = max_t(u64, task->response_us, task->runtime_us);
+	for (i = 0; i < rta_max_iter; i++) {
+		next = task->runtime_us;
+		list_for_each_entry(hp, &mcpu->proc_list.list, list) {
+			if (hp == task) {
+				break;
+			}
+			next += DIV_ROUND_UP_ULL(r, hp->period_us) * hp->runtime_us;
+		}
 
-			del_timer(&(this_task->wakeup_timer));
-            list_del(this_node);
-            kfree(this_task);
+		if (next > task->period_us) {
+			return false;
+		}
+		if (next == r) {
+			task->new_response_us = r;
+			return true;
+		}
+		r = next;
+	}
 
-			/* clear global current task pointer */
-			if (running_task != NULL && running_task->pid == pid) {
-				running_task = NULL;
+	/* not settled in time, reject rather than stall registration */
+	return false;
+}
+
+/* admit_on - adds a task to one CPU if its set stays schedulable there, CPU
+ * lock held; EDF needs total utilization <= 1, RMS tries the hyperbolic bound
+ * and falls back to exact response-time analysis of the new task and those
+ * below it */
+static int admit_on(struct mp2_cpu *mcpu, struct mp2_task_struct *pcb) {
+	struct mp2_task_struct *task;
+	u64 util;
+
+	util = task_util_ppm(pcb);
+	if (edf && mcpu->util_ppm + util > PPM) {
+		return -EINVAL;
+	}
+
+	/* keep proc_list in RMS order, tasks ahead of one have higher priority */
+	list_for_each_entry(task, &mcpu->proc_list.list, list) {
+		if (rms_before(pcb, task)) {
+			break;
+		}
+	}
+	list_add_tail(&pcb->list, &task->list);
+
+	if (!edf && !hyperbolic_ok(mcpu)) {
+		/* higher priority tasks can't be affected by the new one */
+		for (task = pcb; &task->list != &mcpu->proc_list.list;
+			 task = list_next_entry(task, list)) {
+			if (!response_time(mcpu, task)) {
+				list_del(&pcb->list);
+				return -EINVAL;
 			}
-        }
-        
-    }
+		}
+		for (task = pcb; &task->list != &mcpu->proc_list.list;
+			 task = list_next_entry(task, list)) {
+			task->response_us = task->new_response_us;
+		}
+	}
+
+	mcpu->util_ppm += util;
+	pcb->mcpu = mcpu;
+
+	return 0;
+}
+
+/* withdraw - takes an admitted task off its CPU's list and utilization, CPU
+ * lock held */
+static void withdraw(struct mp2_task_struct *pcb) {
+	struct mp2_cpu *mcpu = pcb->mcpu;
+	struct mp2_task_struct *task;
+
+	/* subtract this task from cumulative sum */
+	mcpu->util_ppm -= task_util_ppm(pcb);
+
+	/* response times below it may shrink, restart them from scratch */
+	task = pcb;
+	list_for_each_entry_continue(task, &mcpu->proc_list.list, list) {
+		task->response_us = 0;
+	}
+
+	list_del(&pcb->list);
+}
+
+/* next_cpu - next CPU to try placing a task on, first fit walks CPUs in order
+ * and worst fit takes the least loaded one not yet tried */
+static int next_cpu(int prev, struct cpumask *tried) {
+	struct mp2_cpu *mcpu;
+	u64 least;
+	int cpu, best;
+
+	if (!worst_fit) {
+		cpu = prev;
+		do {
+			cpu = cpumask_next(cpu, cpu_possible_mask);
+		} while (cpu < nr_cpu_ids && !per_cpu(mp2_cpus, cpu).dispatch_thread);
+		return cpu;
+	}
+
+	best = nr_cpu_ids;
+	least = U64_MAX;
+	for_each_possible_cpu(cpu) {
+		mcpu = per_cpu_ptr(&mp2_cpus, cpu);
+		if (mcpu->dispatch_thread && !cpumask_test_cpu(cpu, tried) &&
+			mcpu->util_ppm < least) {
+			least = mcpu->util_ppm;
+			best = cpu;
+		}
+	}
+	return best;
+}
+
+/* admit_task - places a new task on a CPU that can still schedule it and
+ * pins it there, list_mutex held */
+static int admit_task(struct mp2_task_struct *pcb) {
+	struct mp2_cpu *mcpu;
+	cpumask_var_t tried;
+	int error;
+	int cpu;
+
+	if (find_task(pcb->linux_task)) {
+		return -EEXIST;
+	}
+	if (!zalloc_cpumask_var(&tried, GFP_KERNEL)) {
+		return -ENOMEM;
+	}
+
+	/* tasks arrive one at a time, so packing is by arrival, not by size */
+	error = -EINVAL;
+	for (cpu = next_cpu(-1, tried); cpu < nr_cpu_ids; cpu = next_cpu(cpu, tried)) {
+		cpumask_set_cpu(cpu, tried);
+		mcpu = per_cpu_ptr(&mp2_cpus, cpu);
+		mutex_lock(&mcpu->lock);
+		error = admit_on(mcpu, pcb);
+		mutex_unlock(&mcpu->lock);
+		if (!error) {
+			break;
+		}
+	}
+	free_cpumask_var(tried);
+	if (error) {
+		return error;
+	}
+
+	/* a cpuset without this CPU would leave it running elsewhere */
+	error = set_cpus_allowed_ptr(pcb->linux_task, cpumask_of(pcb->mcpu->cpu));
+	if (error) {
+		mutex_lock(&pcb->mcpu->lock);
+		withdraw(pcb);
+		mutex_unlock(&pcb->mcpu->lock);
+		return error;
+	}
+	hash_add(pid_table, &pcb->hash_node, pcb->linux_task->pid);
+
+	return 0;
+}
+
+/* register_task - admits a task, listed under pid, returns 0 or an error */
+static int register_task(struct task_struct *task, pid_t pid,
+						 unsigned long period_us, unsigned long runtime_us) {
+	struct mp2_task_struct *pcb;
+	int error;
+
+	if (period_us == 0 || runtime_us > period_us) {
+		return -EINVAL;
+	}
+
+	/* initialize augmented PCB */
+	pcb = init_pcb(task, pid, period_us, runtime_us);
+	if (pcb == NULL) {
+		return -ENOMEM;
+	}
 
-    /* exit critical section */
-    mutex_unlock(&list_mutex);
+	/* check admission control and add PCB to list */
+	mutex_lock(&list_mutex);
+	error = admit_task(pcb);
+	mutex_unlock(&list_mutex);
+	if (error) {
+		/* failed admission control */
+		#ifdef DEBUG
+		printk(KERN_ALERT "Failed admission control\n");
+		#endif
+		free_pcb(pcb);
+		return error;
+	}
+
+	return 0;
 }
 
-/* mp2_yield - put calling task to sleep and set wakeup timer */
-static void mp2_yield(pid_t pid) {
+/* dereg_task - de-registers a task, or if task is NULL or not registered,
+ * whatever was listed under pid, so a task that died without de-registering
+ * can still be removed; pid 0 matches nothing; returns 0 or -ESRCH */
+static int dereg_task(struct task_struct *task, pid_t pid) {
 	struct mp2_task_struct *this_task;
+	struct mp2_cpu *mcpu;
 
 	/* enter critical section */
 	mutex_lock(&list_mutex);
 
-	/* find process by PID */
-	list_for_each_entry(this_task, &proc_list.list, list) {
-		if (this_task->pid == pid) {
-			break;
+	this_task = task ? find_task(task) : NULL;
+	if (this_task == NULL && pid != 0) {
+		this_task = find_task_pid(pid);
+	}
+	if (this_task == NULL) {
+		mutex_unlock(&list_mutex);
+		return -ESRCH;
+	}
+
+	mcpu = this_task->mcpu;
+	mutex_lock(&mcpu->lock);
+
+	/* the callback never takes a lock, so waiting for it is safe; a node
+	 * can't be unlinked from the middle of the release queue, so drain it */
+	hrtimer_cancel(&this_task->wakeup_timer);
+	hrtimer_cancel(&this_task->budget_timer);
+	if (atomic_read(&this_task->state) == RELEASED) {
+		release_jobs(mcpu);
+	}
+	ready_dequeue(this_task);
+	hash_del(&this_task->hash_node);
+	withdraw(this_task);
+
+	/* clear the CPU's current task pointer */
+	if (mcpu->running_task == this_task) {
+		mcpu->running_task = NULL;
+	}
+
+	mutex_unlock(&mcpu->lock);
+
+	/* no longer partitioned */
+	set_cpus_allowed_ptr(this_task->linux_task, cpu_possible_mask);
+	free_pcb(this_task);
+
+	/* exit critical section */
+	mutex_unlock(&list_mutex);
+
+	return 0;
+}
+
+/* record_completion - charges a job released at release and finished at now
+ * to its task's stats, CPU lock held */
+static void record_completion(struct mp2_task_struct *task, ktime_t release,
+							  ktime_t now) {
+	struct mp2_stats *stats = &task->stats;
+	ktime_t deadline;
+	u64 response_us, tardiness_us;
+
+	deadline = ktime_add_us(release, task->period_us);
+	response_us = max_t(s64, ktime_us_delta(now, release), 0);
+
+	stats->completed++;
+	stats->hist[min_t(u64, response_us * (MP2_HIST_BUCKETS - 1) / task->period_us,
+					  MP2_HIST_BUCKETS - 1)]++;
+
+	/* finishing at the deadline is late, the next job is already out */
+	if (!ktime_before(now, deadline)) {
+		tardiness_us = ktime_us_delta(now, deadline);
+		stats->misses++;
+		stats->total_tardiness_us += tardiness_us;
+		stats->max_tardiness_us = max(stats->max_tardiness_us, tardiness_us);
+	}
+}
+
+/* mp2_yield - put calling task to sleep and set wakeup timer, returns 0 or
+ * -ESRCH */
+static int mp2_yield(struct task_struct *task) {
+	struct mp2_task_struct *this_task;
+	struct mp2_cpu *mcpu;
+	ktime_t now, release;
+	pid_t pid;
+
+	/* find process, holding its CPU keeps it from being freed */
+	mutex_lock(&list_mutex);
+	this_task = find_task(task);
+	if (this_task == NULL) {
+		mutex_unlock(&list_mutex);
+		return -ESRCH;
+	}
+	mcpu = this_task->mcpu;
+	pid = this_task->pid;
+
+	/* enter critical section */
+	mutex_lock(&mcpu->lock);
+	mutex_unlock(&list_mutex);
+
+	/* this job is done with its budget, and with any throttle release, which
+	 * is drained like in dereg_task */
+	hrtimer_cancel(&this_task->budget_timer);
+	if (this_task->throttled) {
+		hrtimer_cancel(&this_task->wakeup_timer);
+		if (atomic_read(&this_task->state) == RELEASED) {
+			release_jobs(mcpu);
 		}
+		this_task->throttled = false;
 	}
 
+	/* the EDF key is about to change, requeue below if still runnable */
+	ready_dequeue(this_task);
+
 	/* set deadline to now + period, if first yield */
-	if (this_task->deadline_jiff == 0) {
-		this_task->deadline_jiff = jiffies +
-									msecs_to_jiffies(this_task->period);
+	now = ktime_get();
+	if (this_task->deadline == 0) {
+		this_task->deadline = ktime_add_us(now, this_task->period_us);
 	}
-	/* set deadline to next deadline, if not first yield */
+	/* set deadline to next deadline, if not first yield, so error never
+	 * accumulates across periods */
 	else {
-		this_task->deadline_jiff += msecs_to_jiffies(this_task->period);
+		record_completion(this_task, this_task->deadline, now);
+		this_task->deadline = ktime_add_us(this_task->deadline,
+										   this_task->period_us);
 	}
 
+	/* the next job starts with a full budget */
+	this_task->budget_ns = this_task->runtime_us * NSEC_PER_USEC;
+	this_task->run_start = now;
+	this_task->overrun = false;
+
+	/* a budget that ran out belonged to the job just finished, a late
+	 * yield must not leave the next job to be throttled for it */
+	atomic_cmpxchg(&this_task->state, EXHAUSTED, RUNNING);
+
+	/* the task may be gone once the lock drops, keep what resume traces */
+	release = this_task->deadline;
+	trace_mp2_job_yield(pid, mcpu->cpu, release);
+
 	/* only set timer and put task to sleep if yield is on time */
-	if (jiffies < this_task->deadline_jiff) {
+	if (ktime_before(now, this_task->deadline)) {
 		/* change state of calling task to SLEEPING */
-		this_task->state = SLEEPING;
+		atomic_set(&this_task->state, SLEEPING);
 
 		/* set timer */
-		mod_timer(&(this_task->wakeup_timer), this_task->deadline_jiff);
+		hrtimer_start(&this_task->wakeup_timer, this_task->deadline,
+					  HRTIMER_MODE_ABS);
 
 		/* put task to sleep */
 		set_task_state(this_task->linux_task, TASK_UNINTERRUPTIBLE);
 	}
+	/* late, the next job is already released */
+	else if (atomic_read(&this_task->state) != SLEEPING) {
+		this_task->stats.released++;
+		trace_mp2_job_release(pid, mcpu->cpu, release);
+		ready_enqueue(this_task);
+	}
 
 	/* exit critical section */
-	mutex_unlock(&list_mutex);
+	mutex_unlock(&mcpu->lock);
 
-	/* wake dispatching thread */
-	wake_up_process(dispatch_thread);
+	/* wake this CPU's dispatching thread */
+	kick_dispatcher(mcpu);
 
 	schedule();
+	trace_mp2_job_resume(pid, mcpu->cpu, release);
+
+	return 0;
 }
 
 /* mp2_write - interface for userapps to register, yield, or de-register */
@@ -372,10 +1020,10 @@ static ssize_t mp2_write( struct file *file, const char __user *buffer,
 	loff_t pos;
 	char operation;
 	pid_t pid;
-    unsigned long period;
-    unsigned long processing_time;
+	struct task_struct *task;
+    unsigned long period_us;
+    unsigned long runtime_us;
 	int error;
-	struct mp2_task_struct *pcb;
 
 	/* should only write to pos 0 */
 	if (*data > 0) {
@@ -406,49 +1054,34 @@ static ssize_t mp2_write( struct file *file, const char __user *buffer,
 		return error;
 	}
 
+	/* get the userapp's task_struct, NULL if it already exited */
+	task = get_task_by_pid(pid);
+	if (task == NULL && operation != 'D') {
+		return -ESRCH;
+	}
+
 	switch (operation) {
 		case 'R':
 			/* get period arg */
 			get_next_arg(procfs_buff, arg_buff, &pos);
-			error = kstrtoul(arg_buff, DECIMAL_BASE, &period);
+			error = parse_us(arg_buff, &period_us);
 			if (error) {
-				return error;
+				break;
 			}
 
 			/* get processing time arg */
 			get_next_arg(procfs_buff, arg_buff, &pos);
-			error = kstrtoul(arg_buff, DECIMAL_BASE, &processing_time);
+			error = parse_us(arg_buff, &runtime_us);
 			if (error) {
-				return error;
+				break;
 			}
 
 			#ifdef DEBUG
-			printk( KERN_ALERT "Registering PID: %d, Period: %lu, ProcTime %lu\n",
-					pid, period, processing_time );
+			printk( KERN_ALERT "Registering PID: %d, Period: %luus, ProcTime %luus\n",
+					pid, period_us, runtime_us );
 			#endif
 
-			/* check admission control */
-			if (acrs + (1000 * processing_time) / period <= LN2) {
-				/* add this task to cumulative sum */
-				acrs += (1000 * processing_time) / period;
-
-				/* initialize augmented PCB */
-				pcb = init_pcb(pid, period, processing_time);
-
-				/* add PCB to list */
-				mutex_lock(&list_mutex);
-				list_add(&(pcb->list), &(proc_list.list));
-				mutex_unlock(&list_mutex);
-			}
-			else {
-				/* failed admission control */
-				#ifdef DEBUG
-				printk(KERN_ALERT "Failed admission control\n");
-				#endif
-				return -EINVAL;
-			}
-
-
+			error = register_task(task, pid, period_us, runtime_us);
 			break;
 
 		case 'Y':
@@ -457,8 +1090,7 @@ static ssize_t mp2_write( struct file *file, const char __user *buffer,
 			#endif
 
 			/* yield process */
-			mp2_yield(pid);
-
+			error = mp2_yield(task);
 			break;
 
 		case 'D':
@@ -466,17 +1098,23 @@ static ssize_t mp2_write( struct file *file, const char __user *buffer,
 			printk(KERN_ALERT "De-registering PID: %d\n", pid);
 			#endif
 
-            /* de-register task */
-            dereg_task(pid);
+            /* de-register task, by its listed PID if it died registered */
+            error = dereg_task(task, pid);
 
 			#ifdef DEBUG
-			printk(KERN_ALERT "Sucessfully de-registered PID: %d\n", pid);
+			if (!error) {
+				printk(KERN_ALERT "Sucessfully de-registered PID: %d\n", pid);
+			}
 			#endif
 
 			break;
 	}
 
-	return procfs_size;
+	if (task != NULL) {
+		put_task_struct(task);
+	}
+
+	return error ? error : procfs_size;
 }
 
 /* mp2_fops - stores links read and write functions to mp2 file */
@@ -486,38 +1124,308 @@ static const struct file_operations mp2_fops = {
 	.write   = mp2_write,
 };
 
+/* get_stats - copies a task's stats out, returns 0 or -ESRCH */
+static int get_stats(struct task_struct *task, struct mp2_stats *stats) {
+	struct mp2_task_struct *this_task;
+
+	mutex_lock(&list_mutex);
+	this_task = find_task(task);
+	if (this_task == NULL) {
+		mutex_unlock(&list_mutex);
+		return -ESRCH;
+	}
+
+	mutex_lock(&this_task->mcpu->lock);
+	*stats = this_task->stats;
+	stats->pid = this_task->pid;
+	mutex_unlock(&this_task->mcpu->lock);
+	mutex_unlock(&list_mutex);
+
+	return 0;
+}
+
+/* stats_show - lists each task's job counts, tardiness and response
+ * histogram, one line per PID */
+static int stats_show(struct seq_file *m, void *v) {
+	struct mp2_task_struct *pcb;
+	struct mp2_cpu *mcpu;
+	int cpu;
+	int i;
+
+	mutex_lock(&list_mutex);
+	for_each_possible_cpu(cpu) {
+		mcpu = per_cpu_ptr(&mp2_cpus, cpu);
+		mutex_lock(&mcpu->lock);
+		list_for_each_entry(pcb, &mcpu->proc_list.list, list) {
+			seq_printf(m, "%d: %llu, %llu, %llu, %llu, %llu, %llu,", pcb->pid,
+					   pcb->stats.released, pcb->stats.completed,
+					   pcb->stats.misses, pcb->stats.overruns,
+					   pcb->stats.max_tardiness_us,
+					   pcb->stats.completed ?
+					   div64_u64(pcb->stats.total_tardiness_us,
+								 pcb->stats.completed) : 0);
+			for (i = 0; i < MP2_HIST_BUCKETS; i++) {
+				seq_printf(m, " %llu", pcb->stats.hist[i]);
+			}
+			seq_putc(m, '\n');
+		}
+		mutex_unlock(&mcpu->lock);
+	}
+	mutex_unlock(&list_mutex);
+
+	return 0;
+}
+
+/* stats_open - output fits no fixed buffer, let seq_file size it */
+static int stats_open(struct inode *inode, struct file *file) {
+	return single_open(file, stats_show, NULL);
+}
+
+/* stats_fops - read-only stats file */
+static const struct file_operations stats_fops = {
+	.owner   = THIS_MODULE,
+	.open    = stats_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
+
+/* cdev_ioctl - binary fast path, every command acts on the calling task so
+ * nothing is parsed and a yield costs one syscall */
+static long cdev_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
+	struct mp2_params reg;
+	struct mp2_stats stats;
+	struct task_struct *task;
+	int error;
+
+	switch (cmd) {
+		case MP2_IOC_REGISTER:
+			if (copy_from_user(&reg, (void __user *) arg, sizeof(reg))) {
+				return -EFAULT;
+			}
+			return register_task(current, task_pid_vnr(current), reg.period_us,
+								 reg.runtime_us);
+
+		case MP2_IOC_YIELD:
+			return mp2_yield(current);
+
+		case MP2_IOC_DEREGISTER:
+			return dereg_task(current, 0);
+
+		case MP2_IOC_STATS:
+			if (copy_from_user(&stats, (void __user *) arg, sizeof(stats))) {
+				return -EFAULT;
+			}
+			if (stats.pid) {
+				task = get_task_by_pid(stats.pid);
+				if (task == NULL) {
+					return -ESRCH;
+				}
+				error = get_stats(task, &stats);
+				put_task_struct(task);
+			}
+			else {
+				error = get_stats(current, &stats);
+			}
+			if (error) {
+				return error;
+			}
+			if (copy_to_user((void __user *) arg, &stats, sizeof(stats))) {
+				return -EFAULT;
+			}
+			return 0;
+	}
+
+	return -ENOTTY;
+}
+
+#ifdef CONFIG_COMPAT
+/* cdev_compat_ioctl - 32-bit callers, arguments are fixed width */
+static long cdev_compat_ioctl(struct file *file, unsigned int cmd,
+							  unsigned long arg) {
+	return cdev_ioctl(file, cmd, (unsigned long) compat_ptr(arg));
+}
+#endif
+
+/* cdev_fops - file operations for /dev/mp2 */
+static const struct file_operations cdev_fops = {
+	.owner          = THIS_MODULE,
+	.unlocked_ioctl = cdev_ioctl,
+#ifdef CONFIG_COMPAT
+	.compat_ioctl   = cdev_compat_ioctl,
+#endif
+};
+
+/* cdev_remove - removes /dev/mp2 and the character device behind it */
+static void cdev_remove(void) {
+	device_destroy(mp2_class, device_num);
+	class_destroy(mp2_class);
+	cdev_del(&mp2_cdev);
+	unregister_chrdev_region(device_num, CDEV_COUNT);
+}
+
+/* cdev_devnode - gives /dev/mp2 the same mode as /proc/mp2/status */
+static char *cdev_devnode(struct device *dev, umode_t *mode) {
+	if (mode) {
+		*mode = RW_PERMISSION;
+	}
+	return NULL;
+}
+
+/* cdev_setup - adds the character device and creates /dev/mp2 for it */
+static int cdev_setup(void) {
+	struct device *dev;
+	int res;
+
+	res = alloc_chrdev_region(&device_num, 0, CDEV_COUNT, CDEV_NAME);
+	if (res != 0) {
+		return res;
+	}
+	cdev_init(&mp2_cdev, &cdev_fops);
+	res = cdev_add(&mp2_cdev, device_num, CDEV_COUNT);
+	if (res != 0) {
+		goto err_region;
+	}
+
+	/* udev makes the node from the class device */
+	mp2_class = class_create(THIS_MODULE, CDEV_NAME);
+	if (IS_ERR(mp2_class)) {
+		res = PTR_ERR(mp2_class);
+		goto err_cdev;
+	}
+	mp2_class->devnode = cdev_devnode;
+	dev = device_create(mp2_class, NULL, device_num, NULL, CDEV_NAME);
+	if (IS_ERR(dev)) {
+		res = PTR_ERR(dev);
+		goto err_class;
+	}
+
+	return 0;
+
+err_class:
+	class_destroy(mp2_class);
+err_cdev:
+	cdev_del(&mp2_cdev);
+err_region:
+	unregister_chrdev_region(device_num, CDEV_COUNT);
+	return res;
+}
+
+/* halt_dispatchers - stops every CPU's dispatching thread but keeps its task
+ * struct, so a timer still in flight only kicks a dead thread */
+static void halt_dispatchers(void) {
+	struct mp2_cpu *mcpu;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		mcpu = per_cpu_ptr(&mp2_cpus, cpu);
+		if (mcpu->dispatch_thread) {
+			get_task_struct(mcpu->dispatch_thread);
+			kthread_stop(mcpu->dispatch_thread);
+		}
+	}
+}
+
+/* put_dispatchers - drops halted dispatching threads once nothing can kick
+ * them */
+static void put_dispatchers(void) {
+	struct mp2_cpu *mcpu;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		mcpu = per_cpu_ptr(&mp2_cpus, cpu);
+		if (mcpu->dispatch_thread) {
+			put_task_struct(mcpu->dispatch_thread);
+			mcpu->dispatch_thread = NULL;
+		}
+	}
+}
+
+/* stop_dispatchers - stops every CPU's dispatching thread */
+static void stop_dispatchers(void) {
+	halt_dispatchers();
+	put_dispatchers();
+}
+
 /* mp2_init - called when module is loaded */
 static int __init mp2_init(void) {
+	struct mp2_cpu *mcpu;
+	struct task_struct *thread;
+	struct sched_param sparam;
+	int cpu;
+	int res;
+
 	#ifdef DEBUG
 	printk(KERN_ALERT "MP2 MODULE LOADING\n");
 	#endif
 
-	/* init admission control ratio */
-	acrs = 0;
-
-    /* init curr process to none */
-    running_task = NULL;
-
-	/* init process list */
-	INIT_LIST_HEAD(&proc_list.list);
-
-	/* init list mutex */
+	/* init PID index and its mutex */
+	hash_init(pid_table);
 	mutex_init(&list_mutex);
 
-	/* init kernel/dispatching thread daemon */
-	dispatch_thread = kthread_run(dispatch_func, NULL, "dispatcher");
+	/* init every CPU's partition */
+	for_each_possible_cpu(cpu) {
+		mcpu = per_cpu_ptr(&mp2_cpus, cpu);
+		mutex_init(&mcpu->lock);
+		mcpu->cpu = cpu;
+		INIT_LIST_HEAD(&mcpu->proc_list.list);
+		mcpu->util_ppm = 0;
+		mcpu->ready_queue = RB_ROOT;
+		mcpu->running_task = NULL;
+		mcpu->dispatch_thread = NULL;
+		init_llist_head(&mcpu->release_queue);
+		atomic_set(&mcpu->kicked, 0);
+	}
+
+	/* init a kernel/dispatching thread daemon bound to each online CPU */
+	for_each_online_cpu(cpu) {
+		mcpu = per_cpu_ptr(&mp2_cpus, cpu);
+		thread = kthread_create(dispatch_func, mcpu, "dispatcher/%d", cpu);
+		if (IS_ERR(thread)) {
+			stop_dispatchers();
+			return PTR_ERR(thread);
+		}
+		kthread_bind(thread, cpu);
+		sparam.sched_priority = DISPATCH_PRIO;
+		sched_setscheduler(thread, SCHED_FIFO, &sparam);
+		mcpu->dispatch_thread = thread;
+		wake_up_process(thread);
+	}
 
 	/* make directory */
 	procfs_dir = proc_mkdir(DIRECTORY, NULL);
 	if (!procfs_dir) {
+		stop_dispatchers();
 		return -ENOMEM;
 	}
 
 	/* make entry */
 	procfs_entry = proc_create(FILENAME, RW_PERMISSION, procfs_dir, &mp2_fops);
 	if (!procfs_entry) {
+		remove_proc_entry(DIRECTORY, NULL);
+		stop_dispatchers();
+		return -ENOMEM;
+	}
+
+	/* make stats entry */
+	stats_entry = proc_create(STATS_FILENAME, READ_PERMISSION, procfs_dir,
+							  &stats_fops);
+	if (!stats_entry) {
+		remove_proc_entry(FILENAME, procfs_dir);
+		remove_proc_entry(DIRECTORY, NULL);
+		stop_dispatchers();
 		return -ENOMEM;
 	}
+
+	/* make /dev/mp2 */
+	res = cdev_setup();
+	if (res != 0) {
+		remove_proc_entry(STATS_FILENAME, procfs_dir);
+		remove_proc_entry(FILENAME, procfs_dir);
+		remove_proc_entry(DIRECTORY, NULL);
+		stop_dispatchers();
+		return res;
+	}
 	
 	#ifdef DEBUG
 	printk(KERN_ALERT "MP2 MODULE LOADED\n");
@@ -530,24 +1438,48 @@ static int __init mp2_init(void) {
 static void __exit mp2_exit(void) {
 	struct mp2_task_struct *this_task;
 	struct list_head *this_node, *temp;
+	struct mp2_cpu *mcpu;
+	struct sched_param sparam;
+	int cpu;
 
 	#ifdef DEBUG
 	printk(KERN_ALERT "MP2 MODULE UNLOADING\n");
 	#endif
 
-	/* remove proc files */
+	/* remove proc files and /dev/mp2 */
+	remove_proc_entry(STATS_FILENAME, procfs_dir);
 	remove_proc_entry(FILENAME, procfs_dir);
 	remove_proc_entry(DIRECTORY, NULL);
-
-	/* clear process list */
-	list_for_each_safe(this_node, temp, &proc_list.list) {
-		this_task = list_entry(this_node, struct mp2_task_struct, list);
-		list_del(this_node);
-		kfree(this_task);
+	cdev_remove();
+
+	/* stop kernel/dispatch threads first, a running one re-arms timers */
+	halt_dispatchers();
+
+	/* stop job releases and budgets, then hand tasks back to the normal
+	 * scheduler whether they were boosted or demoted, and unpin them */
+	sparam.sched_priority = 0;
+	for_each_possible_cpu(cpu) {
+		mcpu = per_cpu_ptr(&mp2_cpus, cpu);
+		list_for_each_entry(this_task, &mcpu->proc_list.list, list) {
+			hrtimer_cancel(&this_task->wakeup_timer);
+			hrtimer_cancel(&this_task->budget_timer);
+			sched_setscheduler(this_task->linux_task, SCHED_NORMAL, &sparam);
+			set_cpus_allowed_ptr(this_task->linux_task, cpu_possible_mask);
+		}
 	}
 
-	/* stop kernel/dispatch thread */
-	kthread_stop(dispatch_thread);
+	/* no timer can kick a dispatcher any more */
+	put_dispatchers();
+
+	/* clear process lists */
+	for_each_possible_cpu(cpu) {
+		mcpu = per_cpu_ptr(&mp2_cpus, cpu);
+		list_for_each_safe(this_node, temp, &mcpu->proc_list.list) {
+			this_task = list_entry(this_node, struct mp2_task_struct, list);
+			list_del(this_node);
+			free_pcb(this_task);
+		}
+	}
 
 	#ifdef DEBUG
 	printk(KERN_ALERT "MP2 MODULE UNLOADED\n");
@@ -0,0 +1,37 @@
+#ifndef __MP2_IOCTL_INCLUDE__
+#define __MP2_IOCTL_INCLUDE__
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define MP2_DEVICE "/dev/mp2"
+#define MP2_IOC_MAGIC 0xB2
+#define MP2_HIST_BUCKETS 11
+
+/* struct mp2_params - REGISTER argument, times in usec */
+struct mp2_params {
+	__u32 period_us;
+	__u32 runtime_us;
+} __attribute__((packed));
+
+/* struct mp2_stats - STATS result, times in usec; hist[i] counts jobs whose
+ * response took tenths i to i + 1 of the period, the last bucket those that
+ * missed their deadline */
+struct mp2_stats {
+	__s32 pid;                                  /* in, 0 for the calling task */
+	__u64 released;
+	__u64 completed;
+	__u64 misses;
+	__u64 overruns;                             /* jobs that ran out of budget */
+	__u64 max_tardiness_us;
+	__u64 total_tardiness_us;                   /* over every completed job */
+	__u64 hist[MP2_HIST_BUCKETS];
+} __attribute__((packed));
+
+/* every command but STATS acts on the calling task, no PID is passed */
+#define MP2_IOC_REGISTER _IOW(MP2_IOC_MAGIC, 1, struct mp2_params)
+#define MP2_IOC_YIELD _IO(MP2_IOC_MAGIC, 2)
+#define MP2_IOC_DEREGISTER _IO(MP2_IOC_MAGIC, 3)
+#define MP2_IOC_STATS _IOWR(MP2_IOC_MAGIC, 4, struct mp2_stats)
+
+#endif
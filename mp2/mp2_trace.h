@@ -0,0 +1,143 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM mp2
+
+#if !defined(__MP2_TRACE_INCLUDE__) || defined(TRACE_HEADER_MULTI_READ)
+#define __MP2_TRACE_INCLUDE__
+
+#include <linux/tracepoint.h>
+#include <linux/ktime.h>
+
+/* every event stamps now with ktime_get, the clock releases are set against,
+ * so latencies can be taken without trusting the trace clock */
+
+/* mp2_job - a task's job, release is the nominal release time of the job the
+ * event refers to */
+DECLARE_EVENT_CLASS(mp2_job,
+
+	TP_PROTO(pid_t pid, int cpu, ktime_t release),
+
+	TP_ARGS(pid, cpu, release),
+
+	TP_STRUCT__entry(
+		__field(pid_t, pid)
+		__field(int, cpu)
+		__field(s64, release)
+		__field(s64, now)
+	),
+
+	TP_fast_assign(
+		__entry->pid = pid;
+		__entry->cpu = cpu;
+		__entry->release = ktime_to_ns(release);
+		__entry->now = ktime_to_ns(ktime_get());
+	),
+
+	TP_printk("pid=%d cpu=%d release=%lld now=%lld", __entry->pid, __entry->cpu,
+			  __entry->release, __entry->now)
+);
+
+/* mp2_job_release - the wakeup timer fired, or a late yield released the next
+ * job at once */
+DEFINE_EVENT(mp2_job, mp2_job_release,
+	TP_PROTO(pid_t pid, int cpu, ktime_t release),
+	TP_ARGS(pid, cpu, release)
+);
+
+/* mp2_job_yield - a job finished, release is when the next one is due */
+DEFINE_EVENT(mp2_job, mp2_job_yield,
+	TP_PROTO(pid_t pid, int cpu, ktime_t release),
+	TP_ARGS(pid, cpu, release)
+);
+
+/* mp2_job_resume - a yielded task is running again, in the job released at
+ * release */
+DEFINE_EVENT(mp2_job, mp2_job_resume,
+	TP_PROTO(pid_t pid, int cpu, ktime_t release),
+	TP_ARGS(pid, cpu, release)
+);
+
+/* mp2_job_overrun - a job used up its declared runtime */
+DEFINE_EVENT(mp2_job, mp2_job_overrun,
+	TP_PROTO(pid_t pid, int cpu, ktime_t release),
+	TP_ARGS(pid, cpu, release)
+);
+
+/* mp2_dispatcher_wakeup - a CPU's dispatching thread woke up */
+TRACE_EVENT(mp2_dispatcher_wakeup,
+
+	TP_PROTO(int cpu),
+
+	TP_ARGS(cpu),
+
+	TP_STRUCT__entry(
+		__field(int, cpu)
+		__field(s64, now)
+	),
+
+	TP_fast_assign(
+		__entry->cpu = cpu;
+		__entry->now = ktime_to_ns(ktime_get());
+	),
+
+	TP_printk("cpu=%d now=%lld", __entry->cpu, __entry->now)
+);
+
+/* mp2_dispatch - the dispatcher's choice, a PID of 0 is no task */
+TRACE_EVENT(mp2_dispatch,
+
+	TP_PROTO(int cpu, pid_t prev_pid, pid_t next_pid),
+
+	TP_ARGS(cpu, prev_pid, next_pid),
+
+	TP_STRUCT__entry(
+		__field(int, cpu)
+		__field(pid_t, prev_pid)
+		__field(pid_t, next_pid)
+		__field(s64, now)
+	),
+
+	TP_fast_assign(
+		__entry->cpu = cpu;
+		__entry->prev_pid = prev_pid;
+		__entry->next_pid = next_pid;
+		__entry->now = ktime_to_ns(ktime_get());
+	),
+
+	TP_printk("cpu=%d prev_pid=%d next_pid=%d now=%lld", __entry->cpu,
+			  __entry->prev_pid, __entry->next_pid, __entry->now)
+);
+
+/* mp2_preempt - the running task lost its CPU before yielding */
+TRACE_EVENT(mp2_preempt,
+
+	TP_PROTO(int cpu, pid_t pid, pid_t by_pid),
+
+	TP_ARGS(cpu, pid, by_pid),
+
+	TP_STRUCT__entry(
+		__field(int, cpu)
+		__field(pid_t, pid)
+		__field(pid_t, by_pid)
+		__field(s64, now)
+	),
+
+	TP_fast_assign(
+		__entry->cpu = cpu;
+		__entry->pid = pid;
+		__entry->by_pid = by_pid;
+		__entry->now = ktime_to_ns(ktime_get());
+	),
+
+	TP_printk("cpu=%d pid=%d by_pid=%d now=%lld", __entry->cpu, __entry->pid,
+			  __entry->by_pid, __entry->now)
+);
+
+#endif
+
+/* out of tree, so point define_trace.h back at this directory */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE mp2_trace
+
+#include <trace/define_trace.h>
@@ -0,0 +1,242 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define LINE_SIZE 1024
+#define TASK_HASH_SIZE 1024
+#define NS_PER_US 1000.0
+
+/* struct samples - growable array of latencies in nsec */
+struct samples {
+    long long *v;
+    size_t n;
+    size_t cap;
+};
+
+/* struct task - one PID's pending job and what its jobs measured */
+struct task {
+    struct task *next;                  /* hash chain */
+    int pid;
+    int cpu;
+    long long release;                  /* nominal release of the pending job */
+    long long released_at;              /* when it was released, 0 if none pending */
+    int woken;
+    int dispatched;
+    unsigned long jobs;
+    unsigned long preempts;
+    struct samples release_lat;         /* nominal release to timer firing */
+    struct samples wakeup_lat;          /* firing to dispatcher wakeup */
+    struct samples dispatch_lat;        /* firing to dispatch decision */
+    struct samples run_lat;             /* firing to task running */
+    struct samples start;               /* nominal release to task running */
+};
+
+static struct task *task_hash[TASK_HASH_SIZE];
+static struct task **tasks;
+static size_t nr_tasks;
+
+/* add_sample - appends a latency, growing the array as needed */
+static void add_sample(struct samples *s, long long ns) {
+    if (s->n == s->cap) {
+        s->cap = s->cap ? 2 * s->cap : 64;
+        s->v = realloc(s->v, s->cap * sizeof(*s->v));
+        if (s->v == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    s->v[s->n++] = ns;
+}
+
+/* get_task - finds a PID's task, creating it on first sight */
+static struct task *get_task(int pid) {
+    struct task **bucket, *t;
+
+    bucket = &task_hash[(unsigned) pid % TASK_HASH_SIZE];
+    for (t = *bucket; t != NULL; t = t->next) {
+        if (t->pid == pid) {
+            return t;
+        }
+    }
+
+    t = calloc(1, sizeof(*t));
+    tasks = realloc(tasks, (nr_tasks + 1) * sizeof(*tasks));
+    if (t == NULL || tasks == NULL) {
+        perror("alloc");
+        exit(1);
+    }
+    t->pid = pid;
+    t->next = *bucket;
+    *bucket = t;
+    tasks[nr_tasks++] = t;
+
+    return t;
+}
+
+/* get_field - reads the integer after key, which starts with a space so
+ * " pid=" doesn't match "prev_pid="; returns 0 if absent */
+static int get_field(const char *line, const char *key, long long *val) {
+    const char *p;
+
+    p = strstr(line, key);
+    if (p == NULL) {
+        return 0;
+    }
+    *val = strtoll(p + strlen(key), NULL, 10);
+
+    return 1;
+}
+
+/* parse_line - feeds one line of ftrace or trace-cmd report output, lines
+ * that aren't mp2 events are skipped */
+static void parse_line(const char *line) {
+    struct task *t;
+    long long pid, cpu, release, now;
+    size_t i;
+
+    if (!get_field(line, " now=", &now)) {
+        return;
+    }
+
+    if (strstr(line, "mp2_job_release:") &&
+        get_field(line, " pid=", &pid) && get_field(line, " cpu=", &cpu) &&
+        get_field(line, " release=", &release)) {
+        t = get_task(pid);
+        t->cpu = cpu;
+        t->jobs++;
+        t->release = release;
+        t->released_at = now;
+        t->woken = 0;
+        t->dispatched = 0;
+        add_sample(&t->release_lat, now - release);
+    }
+    else if (strstr(line, "mp2_dispatcher_wakeup:") && get_field(line, " cpu=", &cpu)) {
+        /* one wakeup serves every job pending on its CPU */
+        for (i = 0; i < nr_tasks; i++) {
+            t = tasks[i];
+            if (t->released_at && !t->woken && t->cpu == cpu) {
+                t->woken = 1;
+                add_sample(&t->wakeup_lat, now - t->released_at);
+            }
+        }
+    }
+    else if (strstr(line, "mp2_dispatch:") && get_field(line, " next_pid=", &pid)) {
+        if (pid == 0) {
+            return;
+        }
+        t = get_task(pid);
+        if (t->released_at && !t->dispatched) {
+            t->dispatched = 1;
+            add_sample(&t->dispatch_lat, now - t->released_at);
+        }
+    }
+    else if (strstr(line, "mp2_preempt:") && get_field(line, " pid=", &pid)) {
+        get_task(pid)->preempts++;
+    }
+    else if (strstr(line, "mp2_job_resume:") && get_field(line, " pid=", &pid) &&
+             get_field(line, " release=", &release)) {
+        t = get_task(pid);
+        /* late jobs never slept, so only resumes into the pending job count */
+        if (t->released_at && t->release == release) {
+            add_sample(&t->run_lat, now - t->released_at);
+            add_sample(&t->start, now - release);
+            t->released_at = 0;
+        }
+    }
+}
+
+/* cmp_ll - qsort comparator */
+static int cmp_ll(const void *a, const void *b) {
+    long long x = *(const long long *) a, y = *(const long long *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* percentile - pct-th percentile of sorted samples, in usec */
+static double percentile(struct samples *s, unsigned int pct) {
+    if (s->n == 0) {
+        return 0;
+    }
+    return s->v[(s->n - 1) * pct / 100] / NS_PER_US;
+}
+
+/* print_samples - sorts and prints p50, p90, p99 and max */
+static void print_samples(struct samples *s) {
+    qsort(s->v, s->n, sizeof(*s->v), cmp_ll);
+    printf(",%.1f,%.1f,%.1f,%.1f", percentile(s, 50), percentile(s, 90),
+           percentile(s, 99), percentile(s, 100));
+}
+
+/* cmp_task - orders tasks by PID */
+static int cmp_task(const void *a, const void *b) {
+    const struct task *x = *(struct task * const *) a, *y = *(struct task * const *) b;
+
+    return x->pid - y->pid;
+}
+
+/* usage - prints options and exits */
+static void usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s [-H] [trace]\n"
+            "Reads ftrace or trace-cmd report output with the mp2 events, from\n"
+            "stdin if no file is given, and prints one CSV row per task, with a\n"
+            "header unless -H is given.\n", name);
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    char line[LINE_SIZE];
+    FILE *f;
+    struct task *t;
+    int header = 1;
+    int opt;
+    size_t i;
+
+    while ((opt = getopt(argc, argv, "H")) != -1) {
+        switch (opt) {
+        case 'H': header = 0; break;
+        default: usage(argv[0]);
+        }
+    }
+
+    f = stdin;
+    if (optind < argc) {
+        f = fopen(argv[optind], "r");
+        if (f == NULL) {
+            perror(argv[optind]);
+            return 1;
+        }
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        parse_line(line);
+    }
+    if (f != stdin) {
+        fclose(f);
+    }
+
+    qsort(tasks, nr_tasks, sizeof(*tasks), cmp_task);
+
+    if (header) {
+        printf("pid,jobs,preempts,"
+               "release_p50_us,release_p90_us,release_p99_us,release_max_us,"
+               "wakeup_p50_us,wakeup_p90_us,wakeup_p99_us,wakeup_max_us,"
+               "dispatch_p50_us,dispatch_p90_us,dispatch_p99_us,dispatch_max_us,"
+               "run_p50_us,run_p90_us,run_p99_us,run_max_us,start_jitter_us\n");
+    }
+    for (i = 0; i < nr_tasks; i++) {
+        t = tasks[i];
+        printf("%d,%lu,%lu", t->pid, t->jobs, t->preempts);
+        print_samples(&t->release_lat);
+        print_samples(&t->wakeup_lat);
+        print_samples(&t->dispatch_lat);
+        print_samples(&t->run_lat);
+
+        /* spread of when jobs actually start within their period */
+        qsort(t->start.v, t->start.n, sizeof(*t->start.v), cmp_ll);
+        printf(",%.1f\n", percentile(&t->start, 99) - percentile(&t->start, 1));
+    }
+
+    return 0;
+}
@@ -7,72 +7,17 @@
 #include <time.h>
 #include <sys/types.h>
 
+#include "libmp2.h"
+
 #define PROC_TIME_MS 94
 #define ITERATIONS 1500000
 #define FACTORIAL_TARGET 20
 
-#define FILENAME "/proc/mp2/status"
-#define BUFF_SIZE 1024
-#define MAX_PID_LEN 20
-
+#define US_PER_MS 1000
 #define NS_PER_MS 1000000
 #define MS_PER_S 1000
 
 
-int read_file_content(char *buf, unsigned buf_size) {
-    FILE *f;
-    int i;
-
-    f = fopen(FILENAME, "r");
-
-    /* check module is runnning */
-    if (f == NULL) {
-        perror("mp2 file not found");
-        return EXIT_FAILURE;
-    }
-
-    /* load status file into buffer as string */
-    i = 0;
-    while (!feof(f) && i < buf_size) {
-        buf[i++] = fgetc(f);
-    }
-
-    /* check file fits into buffer */
-    if (i >= buf_size) {
-        perror("file doesn't fit into buffer");
-        return EXIT_FAILURE;
-    }
-
-    /* null terminate string */
-    buf[i++] = '\0';
-
-    fclose(f);
-
-    return 0;
-}
-
-int write_to_file(char *message) {
-    FILE *f;
-
-    f = fopen(FILENAME, "w");
-
-    /* check module is runnning */
-    if (f == NULL) {
-        perror("mp2 file not found");
-        return EXIT_FAILURE;
-    }
-
-    /* write */
-    if (fprintf(f, "%s", message) < 0) {
-        perror("Error writing to file");
-        return EXIT_FAILURE;
-    }
-
-    fclose(f);
-
-    return 0;
-}
-
 unsigned long get_time_diff(struct timespec *start, struct timespec *stop) {
     unsigned long diff_ms;
 
@@ -99,12 +44,11 @@ unsigned long compute_factorial(unsigned its, unsigned target) {
 }
 
 int main(int argc, char **argv) {
-    pid_t pid;
-    char buf[BUFF_SIZE];
-    char pid_buf[MAX_PID_LEN];
     struct timespec t0, before_job, after_job;
     unsigned long wakeup_time, process_time;
+    unsigned long period_ms;
     unsigned long num_jobs;
+    int fd;
     int i;
 
     /* argument check */
@@ -114,41 +58,20 @@ int main(int argc, char **argv) {
         return EXIT_FAILURE;
     }
 
-    /* get number of jobs from args */
+    /* get period and number of jobs from args */
+    period_ms = strtoul(argv[1], NULL, 0);
     num_jobs = strtoul(argv[2], NULL, 0);
 
-    pid = getpid();
-
-    /* register self */
-    snprintf(buf, sizeof(buf), "R, %d, %s, %d\n", pid, argv[1], (int)PROC_TIME_MS);
-    if (write_to_file(buf) != 0) {
-        errno = EIO;
-        perror("Couldn't write to file");
-        return EXIT_FAILURE;
-    }
-
-    /* reopen file to read */
-    if (read_file_content(buf, sizeof(buf)) != 0) {
-        errno = EIO;
-        perror("Couldn't read file");
-        return EXIT_FAILURE;
-    }
-
-    /* convert PID to searchable substring */
-    if (snprintf(pid_buf, MAX_PID_LEN, "%d:", pid) < 0) {
-        errno = -1;
-        perror("Error while converting PID to string");
+    /* check module is running */
+    fd = mp2_open();
+    if (fd < 0) {
+        perror("mp2 device not found");
         return EXIT_FAILURE;
     }
 
-    /* search for PID in status file */
-    if (strstr(buf, pid_buf) != NULL) {
-        /* PID was found, flag as found */
-        ;
-    }
-    else {
-        errno = -1;
-        perror("PID not found, probably failed admission control");
+    /* register self, fails if admission control rejects us */
+    if (mp2_register(fd, period_ms * US_PER_MS, PROC_TIME_MS * US_PER_MS) != 0) {
+        perror("Couldn't register, probably failed admission control");
         return EXIT_FAILURE;
     }
 
@@ -160,10 +83,8 @@ int main(int argc, char **argv) {
     }
 
     /* yield and signal RMS */
-    snprintf(buf, sizeof(buf), "Y, %d\n", pid);
-    if (write_to_file(buf) != 0) {
-        errno = EIO;
-        perror("Couldn't write to file");
+    if (mp2_yield(fd) != 0) {
+        perror("Couldn't yield");
         return EXIT_FAILURE;
     }
 
@@ -191,22 +112,19 @@ int main(int argc, char **argv) {
         /* print progress */
         printf("wakeup: %lu, process: %lu\n", wakeup_time, process_time);
 
-        /* yield and signal RMS */
-        snprintf(buf, sizeof(buf), "Y, %d\n", pid);
-        if (write_to_file(buf) != 0) {
-            errno = EIO;
-            perror("Couldn't write to file");
+        /* yield and signal RMS, one syscall */
+        if (mp2_yield(fd) != 0) {
+            perror("Couldn't yield");
             return EXIT_FAILURE;
         }
     }
 
     /* de-register */
-    snprintf(buf, sizeof(buf), "D, %d\n", pid);
-    if (write_to_file(buf) != 0) {
-        errno = EIO;
-        perror("Couldn't write to file");
+    if (mp2_deregister(fd) != 0) {
+        perror("Couldn't de-register");
         return EXIT_FAILURE;
     }
+    mp2_close(fd);
 
     return 0;
 }